@@ -41,6 +41,11 @@ def get_clang_command(build_type, cmdLineArgs, linker_args, cxx=False):
     args.append(os.path.join(DS_SYSROOT, "include"))
     if linking:
         args.append("-fuse-ld={0}".format(ld))
+        # the instrumented module is split into this many partitions for
+        # code generation.  the output depends on the number only
+        jobs = os.getenv("DATASHIELD_LTO_JOBS")
+        if jobs:
+            linker_args = linker_args + ["-plugin-opt=jobs={0}".format(jobs)]
     args.append(",".join(linker_args))
     args.extend(cmdLineArgs)
     cmd = " ".join(args)
@@ -8,6 +8,7 @@ args.append("-O3")
 ds_linker_args = ["-Wl",\
 "-plugin-opt=-datashield-lto",\
 "-plugin-opt=-datashield-use-mask",\
+"-plugin-opt=-datashield-post-opt-level=2",\
 "-plugin-opt=-datashield-save-module-after",\
 "-plugin-opt=-datashield-debug-mode",\
 "-plugin-opt=-debug-only=datashield",\
@@ -4,15 +4,26 @@
 #include <sstream>
 
 #include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SCCIterator.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/MemoryBuiltins.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/CallingConv.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/DebugInfo.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/InstIterator.h"
@@ -23,11 +34,19 @@
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/Timer.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/Transforms/Utils/ValueMapper.h"
+#ifdef LLVM_ON_UNIX
+#include <sys/resource.h>
+#endif
 
 using namespace llvm;
 using namespace std;
@@ -40,6 +59,19 @@ STATISTIC(NumLoads, "Total number of loads");
 STATISTIC(NumBoundsChecks, "Total number of bounds checks");
 STATISTIC(NumBoundsStores, "Total number of bounds stores");
 STATISTIC(NumBoundsLoads, "Total number of bounds loads");
+STATISTIC(NumRegisterBoundsFunctions, "Number of functions passed bounds in registers");
+STATISTIC(NumStaticallyInBounds, "Number of bounds checks elided statically");
+STATISTIC(NumRedundantChecks, "Number of bounds checks covered by a dominating check");
+STATISTIC(NumLoopCheckedAccesses, "Number of accesses checked once per loop");
+STATISTIC(NumVersionedLoops, "Number of loops versioned for bounds checks");
+STATISTIC(NumLowFatStoreChecks, "Number of pointer stores checked to stay in their low-fat slot");
+STATISTIC(NumMetadataCopies, "Number of metadata copies after memcpys");
+STATISTIC(NumSparseMetadataCopies, "Number of metadata copies restricted to the pointer words");
+STATISTIC(NumMetadataCopiesElided, "Number of memcpys of pointer-free types without a metadata copy");
+STATISTIC(NumClones, "Number of functions cloned for the sensitivity of their arguments");
+STATISTIC(NumClonedInstructions, "Number of instructions in those clones");
+STATISTIC(NumCallsToMergedClones, "Number of calls sent to an all-sensitive clone over the clone budget");
+STATISTIC(NumCallSiteVisits, "Number of call site visits in the interprocedural sensitivity analysis");
 
 static cl::opt<bool>
 IntegrityOnlyMode("datashield-integrity-only-mode",
@@ -101,6 +133,56 @@ UseSeparationMode("datashield-separation-mode",
     cl::desc("use the separation mode propagation algorith"),
     cl::init(false));
 
+static cl::opt<bool>
+InlineRuntime("datashield-inline-runtime",
+    cl::desc("emit the metadata table and fn arg bounds accesses as IR instead of runtime calls"),
+    cl::init(true));
+
+static cl::opt<bool>
+LoopChecks("datashield-loop-checks",
+    cl::desc("check the whole range of induction variable accesses once before the loop"),
+    cl::init(false));
+
+static cl::opt<bool>
+RegisterBounds("datashield-register-bounds",
+    cl::desc("pass bounds to and from internal functions as extra arguments and return values"),
+    cl::init(true));
+
+static cl::opt<bool>
+SafeStack("datashield-safe-stack",
+    cl::desc("put sensitive allocas on a per thread safe stack instead of the safe heap"),
+    cl::init(false));
+
+static cl::opt<bool>
+LowFatBounds("datashield-lowfat-bounds",
+    cl::desc("compute the bounds of pointers into the runtime's low-fat classes from their value instead of loading them. "
+             "sensitive pointer stores trap when the pointer left the slot it came from, but a reloaded pointer "
+             "is only bounded by its whole slot, not by the object in it, and pointers stored by uninstrumented code aren't checked"),
+    cl::init(false));
+
+static cl::opt<unsigned>
+CloneBudget("datashield-clone-budget",
+    cl::desc("how much the clones for sensitive arguments may grow the module, in percent of its instructions (0 = no limit)"),
+    cl::init(0));
+
+static cl::opt<bool>
+TimeReport("datashield-time-report",
+    cl::desc("print the time and memory each phase of the pass takes"),
+    cl::init(false));
+
+// these mirror the layout of the runtime's metadata table in datashield.c
+// (and of its low-fat classes in lowfat.h) and have to be kept in sync with it
+const uint64_t RTBoundary = (1ull << 32) - 1;         // BOUNDARY
+const uint64_t RTMetadataTable = 1ull << 33;          // METADATA_TABLE_HINT
+const uint64_t RTNumArgEntries = 128;                 // N_ARG_ENTRIES
+const uint64_t RTSafeOrigin = 1ull << 32;             // SAFE_ORIGIN
+const uint64_t RTSafeStackGuard = 1ull << 16;         // SAFE_STACK_GUARD
+const uint64_t RTEscapeSize = 0xffffffffull;          // ESCAPE_SIZE
+const uint64_t RTLowFatMinSize = 16;                  // LOWFAT_MIN_SIZE
+const uint64_t RTLowFatAreaShift = 26;                // LOWFAT_AREA_SHIFT
+const uint64_t RTLowFatSize = 16ull << 26;            // LOWFAT_SIZE
+const uint64_t RTLowFatBase = (1ull << 33) - RTLowFatSize; // LOWFAT_BASE
+
 
 namespace {
 
@@ -117,6 +199,7 @@ Function *safeMallocDebug, *safeCallocDebug;
 
 Function *metadataCopy = nullptr;
 Function *metadataCopyDebug = nullptr;
+Function *metadataCopyLayout = nullptr;
 Function *safeMemCpy = nullptr;
 Function *maskDebug = nullptr;
 Function *safeDealloc = nullptr;
@@ -130,21 +213,28 @@ size_t IDCounter = 0;
 
 vector<StringRef> whiteList;
 
+// sensitive allocas moved to the safe stack, and their size in bytes
+map<Value*, uint64_t> safeStackSlots;
+
+// the global strings made by getDebugString, by their text
+map<string, Value*> debugStrings;
+
+// the state above belongs to one module.  a process may run the pass on
+// several (clang with -datashield-modular and many inputs), and ids or
+// strings left over from the previous one must not leak into the next
+void resetModuleState() {
+  IDCounter = 0;
+  whiteList.clear();
+  safeStackSlots.clear();
+  debugStrings.clear();
+}
+
 typedef Value Bounds;
 typedef map<Function*, vector<GlobalVariable*>> FunctionToGlobalMapTy;
 typedef set<Instruction*> InstructionSet;
 typedef map<Value*, Bounds*> BoundsMap;
 typedef map<Value*, Value*> BasedOnMap;
 
-Function* findFunctionWithSameName(set<Function*> Fs, StringRef name) {
-  for (auto& F : Fs) {
-      if (F->getName() == name) {
-        return F;
-      }
-  }
-  return nullptr;
-}
-
 void getRuntimeMemManFunctions(Module& M) {
     auto mallocTy = FunctionType::get(int8PtrTy, {int64Ty}, false);
     unsafeMalloc = dyn_cast<Function>(M.getOrInsertFunction("__ds_unsafe_malloc", mallocTy));
@@ -204,6 +294,10 @@ void getRuntimeMemManFunctions(Module& M) {
     metadataCopyDebug = dyn_cast<Function>(M.getOrInsertFunction("__ds_metadata_copy_debug", metadataCopyDebugTy));
     assert(metadataCopyDebug && "should be able to get rt functions");
 
+    auto metadataCopyLayoutTy = FunctionType::get(voidTy, {int8PtrTy, int8PtrTy, int64Ty, int64Ty, int64Ty}, false);
+    metadataCopyLayout = dyn_cast<Function>(M.getOrInsertFunction("__ds_metadata_copy_layout", metadataCopyLayoutTy));
+    assert(metadataCopyLayout && "should be able to get rt functions");
+
     safeMemCpy = dyn_cast<Function>(M.getOrInsertFunction("__ds_safe_memcpy", metadataCopyTy));
     assert(safeMemCpy && "should be able to get rt functions");
 
@@ -276,6 +370,181 @@ void insertStatsDump(Module& M) {
 
 }
 
+// bytes of storage that may hold a pointer with a table entry: the pass
+// stores bounds for pointers kept as i64 too, and byte arrays back
+// things like std::aligned_storage
+bool isPointerStorage(Type* T) {
+  return T->isPointerTy() || T->isIntegerTy(64)
+    || (T->isArrayTy() && T->getArrayElementType()->isIntegerTy(8));
+}
+
+bool typeHasPointers(Type* T) {
+  if (isPointerStorage(T)) {
+    return true;
+  }
+  if (auto ST = dyn_cast<StructType>(T)) {
+    if (ST->isOpaque()) {
+      return true; // can't tell
+    }
+    for (auto E : ST->elements()) {
+      if (typeHasPointers(E)) {
+        return true;
+      }
+    }
+    return false;
+  }
+  if (auto AT = dyn_cast<ArrayType>(T)) {
+    return typeHasPointers(AT->getElementType());
+  }
+  if (auto VT = dyn_cast<VectorType>(T)) {
+    return typeHasPointers(VT->getElementType());
+  }
+  return false;
+}
+
+// set bit i of mask if the i-th word of T (placed at offset) may hold a
+// pointer, false if one isn't word aligned or past the 64th word
+bool pointerWordMask(Type* T, const DataLayout& DL, uint64_t offset, uint64_t& mask) {
+  if (!typeHasPointers(T)) {
+    return true;
+  }
+  if (T->isPointerTy() || T->isIntegerTy(64)) {
+    if (offset % 8 || offset / 8 >= 64) {
+      return false;
+    }
+    mask |= 1ull << (offset / 8);
+    return true;
+  }
+  if (isPointerStorage(T)) {
+    // every word the bytes overlap
+    uint64_t end = offset + DL.getTypeAllocSize(T);
+    if (end == offset) {
+      return true;
+    }
+    if ((end - 1) / 8 >= 64) {
+      return false;
+    }
+    for (uint64_t word = offset / 8; word <= (end - 1) / 8; ++word) {
+      mask |= 1ull << word;
+    }
+    return true;
+  }
+  if (auto ST = dyn_cast<StructType>(T)) {
+    if (ST->isOpaque()) {
+      return false;
+    }
+    auto SL = DL.getStructLayout(ST);
+    for (unsigned i = 0, e = ST->getNumElements(); i != e; ++i) {
+      if (!pointerWordMask(ST->getElementType(i), DL, offset + SL->getElementOffset(i), mask)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  if (auto SeqT = dyn_cast<SequentialType>(T)) {
+    auto elemTy = SeqT->getElementType();
+    uint64_t n = isa<ArrayType>(T) ? T->getArrayNumElements() : T->getVectorNumElements();
+    uint64_t elemSize = DL.getTypeAllocSize(elemTy);
+    for (uint64_t i = 0; i < n; ++i) {
+      if (!pointerWordMask(elemTy, DL, offset + i*elemSize, mask)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  return false;
+}
+
+// clang lowers a union to its largest member, which can hide the
+// pointers of the others
+bool typeHasUnions(Type* T) {
+  if (auto ST = dyn_cast<StructType>(T)) {
+    if (ST->hasName() && ST->getName().startswith("union.")) {
+      return true;
+    }
+    for (auto E : ST->elements()) {
+      if (typeHasUnions(E)) {
+        return true;
+      }
+    }
+    return false;
+  }
+  if (auto SeqT = dyn_cast<SequentialType>(T)) {
+    return typeHasUnions(SeqT->getElementType());
+  }
+  return false;
+}
+
+// the type a memcpy operand was cast to i8* from, null if it's just bytes.
+// only bitcasts are looked through: a GEP, even an all-zero one, points
+// into a T and says nothing about the bytes after the field
+Type* copiedType(Value* V) {
+  while (auto op = dyn_cast<Operator>(V)) {
+    if (op->getOpcode() != Instruction::BitCast && op->getOpcode() != Instruction::AddrSpaceCast) {
+      break;
+    }
+    V = op->getOperand(0);
+  }
+  auto PT = dyn_cast<PointerType>(V->getType());
+  if (!PT || !PT->getElementType()->isSized() || PT->getElementType() == Type::getInt8Ty(V->getContext())) {
+    return nullptr;
+  }
+  return PT->getElementType();
+}
+
+// the type a memcpy copies whole objects of, null unless both sides are
+// cast from the same T* and the size is a constant multiple of T's
+Type* copiedObjectType(Value* dest, Value* src, Value* sz, const DataLayout& DL) {
+  Type* T = copiedType(dest);
+  auto size = dyn_cast<ConstantInt>(sz);
+  if (!T || T != copiedType(src) || !size || typeHasUnions(T)) {
+    return nullptr;
+  }
+  uint64_t elemSize = DL.getTypeAllocSize(T);
+  if (!elemSize || size->getZExtValue() % elemSize) {
+    return nullptr;
+  }
+  return T;
+}
+
+// bounds have to follow the pointers a memcpy copies.  the table entries
+// of a range are contiguous like the range itself, so all of them can be
+// copied at once, unless the copied type says only a few words hold
+// pointers or none do
+void insertMetadataCopy(CallInst* call, const DataLayout& DL) {
+  auto dest = call->getArgOperand(0);
+  auto src = call->getArgOperand(1);
+  auto sz = call->getArgOperand(2);
+  IRBuilder<> IRB(call->getNextNode());
+  if (DebugMode) {
+    auto id = ConstantInt::get(int64Ty, IDCounter++);
+    IRB.CreateCall(metadataCopyDebug, {dest, src, sz, id});
+    return;
+  }
+  Type* T = copiedObjectType(dest, src, sz, DL);
+  if (T && !typeHasPointers(T)) {
+    ++NumMetadataCopiesElided;
+    return;
+  }
+  ++NumMetadataCopies;
+  // an array copy repeats the layout of one element
+  while (T && T->isArrayTy() && DL.getTypeAllocSize(T) > 64*8) {
+    T = T->getArrayElementType();
+  }
+  uint64_t mask = 0;
+  uint64_t stride = T ? DL.getTypeAllocSize(T) : 0;
+  if (T && stride && stride % 8 == 0 && stride <= 64*8 &&
+      pointerWordMask(T, DL, 0, mask) &&
+      2*countPopulation(mask) <= stride/8) {
+    ++NumSparseMetadataCopies;
+    IRB.CreateCall(metadataCopyLayout, {dest, src, sz,
+                                        ConstantInt::get(int64Ty, mask),
+                                        ConstantInt::get(int64Ty, stride)});
+  } else {
+    IRB.CreateCall(metadataCopy, {dest, src, sz});
+  }
+}
+
 void replaceAllByNameWith(Module& M, StringRef name, Function& replacement) {
   auto origFn = M.getNamedValue(name);
   if (origFn) {
@@ -393,8 +662,25 @@ Value* getGlobalString(IRBuilder<>& IRB, StringRef msg) {
   return debugPtr;
 }
 
+// keeps global alive through the optimizer and the linker's gc
+void addToUsed(Module& M, GlobalValue* global) {
+  SmallPtrSet<GlobalValue*, 8> used;
+  auto oldUsed = collectUsedGlobalVariables(M, used, false);
+  vector<Constant*> usedVals;
+  for (auto gv : used) {
+    usedVals.push_back(ConstantExpr::getPointerBitCastOrAddrSpaceCast(gv, int8PtrTy));
+  }
+  usedVals.push_back(ConstantExpr::getPointerBitCastOrAddrSpaceCast(global, int8PtrTy));
+  if (oldUsed) {
+    oldUsed->eraseFromParent();
+  }
+  auto usedTy = ArrayType::get(int8PtrTy, usedVals.size());
+  auto newUsed = new GlobalVariable(M, usedTy, false, GlobalValue::AppendingLinkage,
+                                    ConstantArray::get(usedTy, usedVals), "llvm.used");
+  newUsed->setSection("llvm.metadata");
+}
+
 Value* getDebugString(IRBuilder<>& IRB, Instruction* I) {
-  static map<string, Value*> strMap;
   DebugLoc const& dl = I->getDebugLoc();
   stringstream ss;
   if (dl.get()) {
@@ -405,12 +691,12 @@ Value* getDebugString(IRBuilder<>& IRB, Instruction* I) {
   } else {
     ss << "no debug symbols available";
   }
-  if (strMap.count(ss.str())) {
-    return strMap[ss.str()];
+  if (debugStrings.count(ss.str())) {
+    return debugStrings[ss.str()];
   } else {
     auto debugVal = IRB.CreateGlobalString(ss.str(), "debuginfo");
     auto debugPtr = ConstantExpr::getPointerCast(debugVal, int8PtrTy);
-    strMap[ss.str()] = debugPtr;
+    debugStrings[ss.str()] = debugPtr;
     return debugPtr;
   }
 }
@@ -519,6 +805,14 @@ bool isWhiteListed(Function& F) {
   return false;
 }
 
+size_t countInstructions(Function& F) {
+  size_t n = 0;
+  for (auto& BB : F) {
+    n += BB.size();
+  }
+  return n;
+}
+
 Function* duplicateFunction(Module& M, Function& oldF, StringRef newName) {
   ValueToValueMapTy vMap;
   // fix me: change true to false in CloneFunction once they fix my bug
@@ -528,8 +822,8 @@ Function* duplicateFunction(Module& M, Function& oldF, StringRef newName) {
   return newF;
 }
 
-template<typename T>
-void dumpSet(string header, set<T*> theSet) {
+template<typename SetTy>
+void dumpSet(string header, const SetTy& theSet) {
   dbgs() << header;
   for (auto i : theSet) {
     dbgs() << "\t";
@@ -544,13 +838,59 @@ void saveModule(Module& M, Twine filename) {
   M.print(file, nullptr, true);
 }
 
+// times the phases of the pass for -datashield-time-report.  each phase
+// runs until the next one starts.  the heap figure is what the compiler
+// holds right after the phase, the peak RSS is the process's so far
+class PhaseReport {
+  struct Phase {
+    string name;
+    TimeRecord time;
+    size_t heapAfter;
+  };
+  vector<Phase> phases;
+  bool running = false;
+  public:
+  void start(StringRef name) {
+    if (!TimeReport) { return; }
+    stop();
+    phases.push_back({name, TimeRecord::getCurrentTime(true), 0});
+    running = true;
+  }
+  void stop() {
+    if (!running) { return; }
+    auto& phase = phases.back();
+    auto start = phase.time;
+    phase.time = TimeRecord::getCurrentTime(false);
+    phase.time -= start;
+    phase.heapAfter = sys::Process::GetMallocUsage();
+    running = false;
+  }
+  void print(raw_ostream& os) {
+    if (!TimeReport) { return; }
+    stop();
+    os << "[DATASHIELD] time report (wall s, user+sys s, heap after MiB):\n";
+    for (auto& phase : phases) {
+      os << format("  %-28s %9.3f %9.3f %9.1f\n", phase.name.c_str(),
+                   phase.time.getWallTime(), phase.time.getProcessTime(),
+                   phase.heapAfter / (1024.0 * 1024.0));
+    }
+#ifdef LLVM_ON_UNIX
+    struct rusage usage;
+    if (!getrusage(RUSAGE_SELF, &usage)) {
+      // in KiB on linux
+      os << format("  peak RSS %.1f MiB\n", usage.ru_maxrss / 1024.0);
+    }
+#endif
+  }
+};
+
 // end static helper functions
 
 class TypeSet {
   private:
-  set<Type*> sensTys;
-  set<Type*> nonsensTys;
-  set<Type*> loopDetector;
+  SmallPtrSet<Type*, 32> sensTys;
+  SmallPtrSet<Type*, 32> nonsensTys;
+  SmallPtrSet<Type*, 32> loopDetector;
   TypeSet() {}
   public:
   static TypeSet getEmpty() {
@@ -562,7 +902,7 @@ class TypeSet {
       isSensitiveTypeRecursive(t);
     }
   }
-  pair<set<Type*>::iterator,bool> insert(Type* ty) {
+  pair<SmallPtrSet<Type*, 32>::iterator,bool> insert(Type* ty) {
     return sensTys.insert(ty);
   }
   size_t count(Type* ty) const {
@@ -673,24 +1013,32 @@ class TypeSet {
 };
 
 class ValueSet {
-  set<Value*> vals;
+  DenseSet<Value*> vals;
+  // what count() found for constant exprs and vectors: ~0 if they refer to
+  // a sensitive value, the size of vals at the time if they don't.  vals
+  // only grows during the analysis, so a miss holds until it does and a hit
+  // until replace() takes something out
+  mutable DenseMap<Constant*, size_t> constCounts;
   TypeSet& sensitiveTypes;
   ValueSet(TypeSet& sensitiveTypes) : sensitiveTypes(sensitiveTypes){}
   public:
   static ValueSet getEmpty(TypeSet& sensitiveTypes) {
       return ValueSet(sensitiveTypes);
   }
-  const set<Value*> getVals() {
+  const DenseSet<Value*>& getVals() const {
     return vals;
   }
   ValueSet(Module& M, TypeSet& sensitiveTypes): sensitiveTypes(sensitiveTypes) {
     findSensitiveTypedValues(M);
   }
-  bool isChanged = false;
-  pair<set<Value*>::iterator, bool> insert(Value* v) {
+  // inserted but not propagated to their users yet, see
+  // SensitivityAnalysis::propagateSensitivity
+  vector<Value*> pending;
+  pair<DenseSet<Value*>::iterator, bool> insert(Value* v) {
     if (!(isa<ConstantInt>(v) || isa<ConstantFP>(v) || isa<ConstantPointerNull>(v) || isa<UndefValue>(v))) {
       auto rv = vals.insert(v);
       if (rv.second) {
+        pending.push_back(v);
         //v->dump();
         if (auto ce = dyn_cast<ConstantExpr>(v)) {
           insert(ce->getOperand(0));
@@ -702,30 +1050,51 @@ class ValueSet {
           }
         }
       }
-      isChanged |= rv.second;
       return rv;
     }
-    return pair<set<Value*>::iterator, bool>(vals.end(), false);
+    return pair<DenseSet<Value*>::iterator, bool>(vals.end(), false);
   }
   size_t count(Value* v) const {
     auto rv = vals.count(v);
     if (rv) { return rv; }
-    if (auto ce = dyn_cast<ConstantExpr>(v)) {
+    if (!isa<ConstantExpr>(v) && !isa<ConstantDataVector>(v)) { return 0; }
+    auto c = cast<Constant>(v);
+    auto known = constCounts.find(c);
+    if (known != constCounts.end()) {
+      if (known->second == ~size_t(0)) { return 1; }
+      if (known->second == vals.size()) { return 0; }
+    }
+    auto found = countConstant(c);
+    constCounts[c] = found ? ~size_t(0) : vals.size();
+    return found ? 1 : 0;
+  }
+  size_t size() const {
+    return vals.size();
+  }
+  // for values that are rewritten after the analysis finished
+  void replace(Value* from, Value* to) {
+    if (vals.erase(from)) {
+      constCounts.clear();
+      insert(to);
+    }
+  }
+  void dump() {
+    dumpSet("sensitive values set: ", vals);
+  }
+  private:
+  size_t countConstant(Constant* c) const {
+    if (auto ce = dyn_cast<ConstantExpr>(c)) {
       return count(ce->getOperand(0));
-    } else if (auto vec = dyn_cast<ConstantDataVector>(v)) {
+    } else if (auto vec = dyn_cast<ConstantDataVector>(c)) {
       for (unsigned i = 0, e = vec->getNumElements(); i != e; ++i) {
         if (auto cnt = count(vec->getElementAsConstant(i))) {
             return cnt;
         }
       }
-      return 0;
-    } else {
-      return 0;
     }
+    return 0;
   }
-  void dump() {
-    dumpSet("sensitive values set: ", vals);
-  }
+  public:
   void findSensitiveTypedValues(Function& F) {
     for (inst_iterator It = inst_begin(&F), Ie = inst_end(&F); It != Ie;) {
       Instruction *I = &*(It++);
@@ -733,7 +1102,7 @@ class ValueSet {
         auto val = op.get();
         //if (sensitiveTypes.count(val->getType())) {
         if (sensitiveTypes.isSensitiveTypeRecursive(val->getType())) {
-          vals.insert(val);
+          if (vals.insert(val).second) { pending.push_back(val); }
         }
       }
     }
@@ -746,14 +1115,14 @@ class ValueSet {
       auto type = g.getType();
       //if (sensitiveTypes.count(type)) {
       if (sensitiveTypes.isSensitiveTypeRecursive(type)) {
-        vals.insert(&g);
+        if (vals.insert(&g).second) { pending.push_back(&g); }
       }
     }
     // look through all function arguments
     for (auto& F : M) {
       for (auto& a : F.args()) {
         if (sensitiveTypes.isSensitiveTypeRecursive(a.getType())) {
-          vals.insert(&a);
+          if (vals.insert(&a).second) { pending.push_back(&a); }
         }
       }
     }
@@ -991,12 +1360,123 @@ class CallInfoContainer {
 
 class MemoryRegioner {
   Function *unsafeMmap; // there is no safeMmap currently
+  Function *unsafeMunmap;
+  Function *unsafeMremap;
+  GlobalVariable* safeStackPtr = nullptr;
   ValueSet& sensitiveSet;
   void getRuntimeFunctions(Module& M) {
 
     auto mmapTy = FunctionType::get(int8PtrTy, {int8PtrTy, int64Ty, int32Ty, int32Ty, int32Ty, int64Ty}, false);
     unsafeMmap = dyn_cast<Function>(M.getOrInsertFunction("__ds_unsafe_mmap", mmapTy));
     assert(unsafeMmap && "should be able to get rt functions");
+    // the runtime keeps track of the low 4GB it hands out, so unmapping
+    // and remapping what came from __ds_unsafe_mmap has to go through it too
+    auto munmapTy = FunctionType::get(int32Ty, {int8PtrTy, int64Ty}, false);
+    unsafeMunmap = dyn_cast<Function>(M.getOrInsertFunction("__ds_unsafe_munmap", munmapTy));
+    assert(unsafeMunmap && "should be able to get rt functions");
+    auto mremapTy = FunctionType::get(int8PtrTy, {int8PtrTy, int64Ty, int64Ty, int32Ty}, true);
+    unsafeMremap = dyn_cast<Function>(M.getOrInsertFunction("__ds_unsafe_mremap", mremapTy));
+    assert(unsafeMremap && "should be able to get rt functions");
+
+    if (useSafeStack()) {
+      safeStackPtr = dyn_cast<GlobalVariable>(M.getOrInsertGlobal("__ds_safe_stack_ptr", int8PtrTy));
+      assert(safeStackPtr && "should be able to get the safe stack pointer");
+      safeStackPtr->setThreadLocalMode(GlobalValue::InitialExecTLSModel);
+    }
+  }
+  bool useSafeStack() {
+    // debug mode logs every safe allocation and prefixed functions
+    // would truncate the address of the tls safe stack pointer
+    return SafeStack && !DebugMode && !UsePrefix;
+  }
+  // the part of a frame the safe stack guard can catch, see
+  // SAFE_STACK_GUARD in the runtime.  allocas past it stay on the safe heap
+  uint64_t safeStackFrameLimit() {
+    return RTSafeStackGuard;
+  }
+  // allocate a frame for the static sensitive allocas by moving the thread's
+  // safe stack pointer down on entry, and move it back before returning.
+  // returns the new safe stack pointer
+  Value* moveSensitiveAllocsToSafeStack(Function& F, const DataLayout& DL, vector<AllocaInst*>& allocas) {
+    uint64_t frameSize = 0;
+    unsigned frameAlign = 16;
+    vector<uint64_t> offsets;
+    vector<uint64_t> sizes;
+    for (auto alloca : allocas) {
+      auto ty = alloca->getAllocatedType();
+      auto nElements = cast<ConstantInt>(alloca->getArraySize())->getZExtValue();
+      auto sz = DL.getTypeAllocSize(ty) * nElements;
+      unsigned align = max(alloca->getAlignment(), DL.getPrefTypeAlignment(ty));
+      frameAlign = max(frameAlign, align);
+      frameSize = alignTo(frameSize, align);
+      offsets.push_back(frameSize);
+      sizes.push_back(sz);
+      frameSize += sz;
+    }
+    frameSize = alignTo(frameSize, 16);
+
+    IRBuilder<> IRB(&*F.getEntryBlock().getFirstInsertionPt());
+    auto oldTop = IRB.CreateLoad(safeStackPtr, "ds_safe_sp");
+    Value* frame = IRB.CreateGEP(oldTop, IRB.getInt64(-(int64_t)frameSize));
+    if (frameAlign > 16) {
+      auto frameInt = IRB.CreatePtrToInt(frame, int64Ty);
+      frameInt = IRB.CreateAnd(frameInt, IRB.getInt64(~(uint64_t)(frameAlign - 1)));
+      frame = IRB.CreateIntToPtr(frameInt, int8PtrTy);
+    }
+    frame->setName("ds_safe_frame");
+    IRB.CreateStore(frame, safeStackPtr);
+
+    for (unsigned i = 0; i < allocas.size(); ++i) {
+      auto alloca = allocas[i];
+      auto slot = IRB.CreateConstInBoundsGEP1_64(frame, offsets[i], alloca->getName() + "_slot");
+      auto replCasted = IRB.CreateBitCast(slot, alloca->getType(), alloca->getName() + "_replaced");
+      safeStackSlots[slot] = sizes[i];
+      for (auto user : alloca->users()) {
+        sensitiveSet.insert(user);
+      }
+      alloca->replaceAllUsesWith(replCasted);
+      alloca->eraseFromParent();
+      sensitiveSet.insert(slot);
+      sensitiveSet.insert(replCasted);
+    }
+
+    vector<ReturnInst*> returns;
+    for (auto& BB : F) {
+      if (auto ret = dyn_cast<ReturnInst>(BB.getTerminator())) {
+        returns.push_back(ret);
+      }
+    }
+    for (auto ret : returns) {
+      Instruction* insertionPoint = ret;
+      if (auto prev = dyn_cast_or_null<CallInst>(ret->getPrevNode())) {
+        if (prev->isMustTailCall()) {
+          insertionPoint = prev;
+        }
+      }
+      new StoreInst(oldTop, safeStackPtr, insertionPoint);
+    }
+    return frame;
+  }
+  // longjmp skips the epilogues of the frames it unwinds, so after a call
+  // that returns twice the safe stack pointer goes back to where this
+  // function's frame has it.  sp is that value if the function has a frame
+  void restoreSafeStackAfterSetjmp(Function& F, Value* sp) {
+    vector<CallInst*> setjmps;
+    for (inst_iterator It = inst_begin(&F), Ie = inst_end(&F); It != Ie; ++It) {
+      if (auto CI = dyn_cast<CallInst>(&*It)) {
+        if (CI->getCalledFunction() && CI->canReturnTwice()) {
+          setjmps.push_back(CI);
+        }
+      }
+    }
+    if (setjmps.empty()) { return; }
+    if (!sp) {
+      IRBuilder<> IRB(&*F.getEntryBlock().getFirstInsertionPt());
+      sp = IRB.CreateLoad(safeStackPtr, "ds_safe_sp");
+    }
+    for (auto CI : setjmps) {
+      new StoreInst(sp, safeStackPtr, CI->getNextNode());
+    }
   }
   CallInst* getSafeReplacementForAllocationOrFree(CallInst& call, TargetLibraryInfo& TLI) {
     IRBuilder<> IRB(&call);
@@ -1071,6 +1551,24 @@ class MemoryRegioner {
                 replMap.push_back(pair<Instruction*, Instruction*>(call, replCall));
               }
             }
+            if (call->getCalledFunction()->getName() == "munmap") {
+              if (!sensitiveSet.count(call->getArgOperand(0))) {
+                IRBuilder<> IRB(call);
+                auto replCall = IRB.CreateCall(unsafeMunmap, {
+                                                 call->getArgOperand(0),
+                                                 call->getArgOperand(1)},
+                                               call->getName() + "_unsafe");
+                replMap.push_back(pair<Instruction*, Instruction*>(call, replCall));
+              }
+            }
+            if (call->getCalledFunction()->getName() == "mremap") {
+              if (!sensitiveSet.count(call) && !sensitiveSet.count(call->getArgOperand(0))) {
+                IRBuilder<> IRB(call);
+                vector<Value*> args(call->arg_begin(), call->arg_end());
+                auto replCall = IRB.CreateCall(unsafeMremap, args, call->getName() + "_unsafe");
+                replMap.push_back(pair<Instruction*, Instruction*>(call, replCall));
+              }
+            }
             if (call->getCalledFunction()->getName() == "strerror") {
               if (sensitiveSet.count(call)) {
                 IRBuilder<> IRB(call);
@@ -1145,6 +1643,37 @@ class MemoryRegioner {
       }
     }
 
+    if (useSafeStack()) {
+      // dynamically sized allocas stay on the safe heap, and so does
+      // whatever would make the frame bigger than the guard below the stack
+      vector<AllocaInst*> staticAllocas, dynamicAllocas;
+      // (an upper bound of the frame moveSensitiveAllocsToSafeStack lays
+      // out: every slot padded by its alignment, plus realigning the frame)
+      uint64_t frameSize = 16;
+      unsigned frameAlign = 16;
+      for (auto alloca : sensitiveAllocas) {
+        if (alloca->isStaticAlloca()) {
+          auto ty = alloca->getAllocatedType();
+          auto nElements = cast<ConstantInt>(alloca->getArraySize())->getZExtValue();
+          auto sz = DL.getTypeAllocSize(ty) * nElements;
+          unsigned align = max(alloca->getAlignment(), DL.getPrefTypeAlignment(ty));
+          if (frameSize + sz + align + max(frameAlign, align) <= safeStackFrameLimit()) {
+            frameSize += sz + align;
+            frameAlign = max(frameAlign, align);
+            staticAllocas.push_back(alloca);
+            continue;
+          }
+        }
+        dynamicAllocas.push_back(alloca);
+      }
+      Value* safeSP = nullptr;
+      if (staticAllocas.size() != 0) {
+        safeSP = moveSensitiveAllocsToSafeStack(F, DL, staticAllocas);
+      }
+      restoreSafeStackAfterSetjmp(F, safeSP);
+      sensitiveAllocas = dynamicAllocas;
+    }
+
     if (sensitiveAllocas.size() == 0) { return; }
 
     // replace the allocas with mallocs and erase the allocas
@@ -1266,10 +1795,9 @@ class Sandboxer {
   StringRef maskMDString = "mask";
   FunctionType* cloneFnArgTy;
   Function* buildStackSwitch = nullptr;
-  Function* cloneFn = nullptr;
+  Function* callOnStackFn = nullptr;
   Function* dsUnsafeCopyArgv = nullptr;
   Function* dsGetStackPtr = nullptr;
-  Function* dsWait = nullptr;
   Function* copyEnvironToUnsafe = nullptr;
   Function* copyEnvironToSafe = nullptr;
   Function* unsafeGetTemporaryBuffer = nullptr;
@@ -1282,9 +1810,9 @@ class Sandboxer {
 
     cloneFnArgTy = FunctionType::get(int32Ty, {int8PtrTy}, false);
     auto fptrTy = cloneFnArgTy->getPointerTo();
-    auto cloneTy = FunctionType::get(int32Ty, {fptrTy, int8PtrTy, int32Ty, int8PtrTy}, true);
-    cloneFn = dyn_cast<Function>(M.getOrInsertFunction("clone", cloneTy));
-    assert(cloneFn && "function shouldnt be null!");
+    auto callOnStackTy = FunctionType::get(int32Ty, {fptrTy, int8PtrTy, int8PtrTy}, false);
+    callOnStackFn = dyn_cast<Function>(M.getOrInsertFunction("__ds_call_on_stack", callOnStackTy));
+    assert(callOnStackFn && "function shouldnt be null!");
 
     auto getStackPtrTy = FunctionType::get(int8PtrTy, {});
     dsGetStackPtr = dyn_cast<Function>(M.getOrInsertFunction("__ds_get_unsafe_stack_top", getStackPtrTy));
@@ -1297,10 +1825,6 @@ class Sandboxer {
     safeCopyArgv = dyn_cast<Function>(M.getOrInsertFunction("__ds_copy_argv_to_safe_heap", dsCopyArgvTy));
     assert(safeCopyArgv && "should be able to get rt functions");
 
-    auto dsWaitTy = FunctionType::get(int32Ty, {int32Ty}, false);
-    dsWait = dyn_cast<Function>(M.getOrInsertFunction("__ds_waitpid", dsWaitTy));
-    assert(dsWait && "should be able to get rt functions");
-
     auto copyEnvironToUnsafeTy = FunctionType::get(int8PtrPtrTy, {int8PtrPtrTy}, false);
     copyEnvironToUnsafe = dyn_cast<Function>(M.getOrInsertFunction("__ds_copy_environ_to_unsafe", copyEnvironToUnsafeTy));
     assert(copyEnvironToUnsafe && "should be able to get rt functions");
@@ -1382,14 +1906,9 @@ class Sandboxer {
     IRB.CreateStore(copiedArgv, argv_idx);
     auto argsAsVoidPtr = IRB.CreateBitCast(mainArgsPtr, int8PtrTy);
 
-    // call the trampoline
+    // run the trampoline on the unsafe stack, in this thread
     auto tramp = createTrampoline(M, *cloneFnArgTy, oldMain, *mainArgTy);
-    //auto flags = ConstantInt::get(int32Ty, 8465); // SIGCHLD | CLONE_PTRACE | CLONE_VM
-    auto flags = ConstantInt::get(int32Ty, -2147473647); // SIGCHLD | CLONE_PTRACE | CLONE_VM | CLONE_IO | CLONE_FS | CLONE_FILES
-    auto pid = IRB.CreateCall(cloneFn, {tramp, stack_top, flags, argsAsVoidPtr}, "cloneMain");
-
-    // wait, get our exit code, and return
-    auto exitCode = IRB.CreateCall(dsWait, {pid}, "exit_code");
+    auto exitCode = IRB.CreateCall(callOnStackFn, {tramp, argsAsVoidPtr, stack_top}, "exit_code");
 
     IRB.CreateRet(exitCode);
 
@@ -1596,6 +2115,21 @@ class Sandboxer {
     }
     replacementMap.replaceAndErase();
   }
+  void preventInliningIntoUnmaskedFunctions(Module& M) {
+    // with prefixing the mask is applied per function at code emission
+    // (see X86MCInstLower) so a masked body must never be inlined into
+    // a function that doesn't get prefixed
+    if (!UsePrefix) { return; }
+    for (auto& F : M) {
+      if (F.isDeclaration()) { continue; }
+      if (F.getMetadata(maskMDString) && !F.getName().startswith("__")) { continue; }
+      for (inst_iterator It = inst_begin(F), Ie = inst_end(F); It != Ie; ++It) {
+        if (auto call = dyn_cast<CallInst>(&*It)) {
+          call->setIsNoInline();
+        }
+      }
+    }
+  }
   Sandboxer(Module& M) {
     maskMD = MDNode::get(M.getContext(), MDString::get(M.getContext(), maskMDString));
     getRuntimeFunctions(M);
@@ -1617,66 +2151,106 @@ class SensitivityAnalysis {
     }
     return false;
   }
-  void propagateSensitivity(Function& F) {
-    bool changed;
-    do {
-      changed = false;
-      for (inst_iterator It = inst_begin(&F), Ie = inst_end(&F); It != Ie;) {
-        Instruction *I = &*(It++);
-        if (isa<BranchInst>(I)) { continue; } // ignore these
+  // the propagation rule for a single instruction: once it or one of its
+  // operands is sensitive, all of them are, except for calls and branches
+  void propagateThrough(Instruction* I) {
+    if (isa<BranchInst>(I)) { return; } // ignore these
+    if (auto call = dyn_cast<CallInst>(I)) {
+      // allow the operands of memcpy to progagate sensitivity
+      if (call->getCalledFunction() && call->getCalledFunction()->getName().startswith("llvm.memcpy")) {
+        if (sensitiveSet.count(call->getArgOperand(0)) || sensitiveSet.count(call->getArgOperand(1))) {
+          sensitiveSet.insert(call->getArgOperand(0));
+          sensitiveSet.insert(call->getArgOperand(1));
+          return;
+        }
+      } else if (call->getCalledFunction() && call->getCalledFunction()->getName().startswith("strchr")) {
+        if (sensitiveSet.count(call->getArgOperand((0))) || sensitiveSet.count(call)) {
+          sensitiveSet.insert(call->getArgOperand(0));
+          sensitiveSet.insert(call);
+          return;
+        }
+      } else {
+        return;
+      }
+    } // we allow CallInst with mixed sensitivity so dont propagate them
+    if (UseSeparationMode) {
+      switch (I->getOpcode()) {
+        case Instruction::Add: case Instruction::FAdd:
+        case Instruction::Sub: case Instruction::FSub:
+        case Instruction::Mul: case Instruction::FMul:
+        case Instruction::UDiv: case Instruction::SDiv: case Instruction::FDiv:
+        case Instruction::URem: case Instruction::SRem: case Instruction::FRem:
+        case Instruction::And: case Instruction::Or: case Instruction::Xor:
+          return;
+        default:
+          break;
+      }
+    }
+    if (anySensitiveOperands(I)) {
+      sensitiveSet.insert(I);
+      for (unsigned i = 0, e = I->getNumOperands(); i != e; ++i) {
+        sensitiveSet.insert(I->getOperand(i));
+      }
+    }
+  }
+  void propagateToUsers(Value* V) {
+    for (auto U : V->users()) {
+      if (auto I = dyn_cast<Instruction>(U)) {
+        if (!isWhiteListed(*I->getFunction())) {
+          propagateThrough(I);
+        }
         if (auto call = dyn_cast<CallInst>(I)) {
-          // allow the operands of memcpy to progagate sensitivity
-          if (call->getCalledFunction() && call->getCalledFunction()->getName().startswith("llvm.memcpy")) {
-            if (sensitiveSet.count(call->getArgOperand(0)) || sensitiveSet.count(call->getArgOperand(1))) {
-              changed |= sensitiveSet.insert(call->getArgOperand(0)).second;
-              changed |= sensitiveSet.insert(call->getArgOperand(1)).second;
-              continue;
-            }
-          } else if (call->getCalledFunction() && call->getCalledFunction()->getName().startswith("strchr")) {
-            if (sensitiveSet.count(call->getArgOperand((0))) || sensitiveSet.count(call)) {
-              changed |= sensitiveSet.insert(call->getArgOperand(0)).second;
-              changed |= sensitiveSet.insert(call).second;
-              continue;
-            }
-          } else {
-            continue;
-          }
-        } // we allow CallInst with mixed sensitivity so dont propagate them
-        if (UseSeparationMode) {
-          if (I->getOpcode() == Instruction::Add) { continue; }
-          if (I->getOpcode() == Instruction::FAdd) { continue; }
-          if (I->getOpcode() == Instruction::Sub) { continue; }
-          if (I->getOpcode() == Instruction::FSub) { continue; }
-          if (I->getOpcode() == Instruction::Mul) { continue; }
-          if (I->getOpcode() == Instruction::FMul) { continue; }
-          if (I->getOpcode() == Instruction::UDiv) { continue; }
-          if (I->getOpcode() == Instruction::SDiv) { continue; }
-          if (I->getOpcode() == Instruction::FDiv) { continue; }
-          if (I->getOpcode() == Instruction::URem) { continue; }
-          if (I->getOpcode() == Instruction::SRem) { continue; }
-          if (I->getOpcode() == Instruction::FRem) { continue; }
-          if (I->getOpcode() == Instruction::And) { continue; }
-          if (I->getOpcode() == Instruction::Or) { continue; }
-          if (I->getOpcode() == Instruction::Xor) { continue; }
-        }
-        if (anySensitiveOperands(I)) {
-          changed |= sensitiveSet.insert(I).second;
-          for (unsigned i = 0, e = I->getNumOperands(); i != e; ++i) {
-            auto v = I->getOperand(i);
-            changed |= sensitiveSet.insert(v).second;
-          }
+          markCallDirty(call);
+        }
+      } else if (auto ce = dyn_cast<ConstantExpr>(U)) {
+        // ValueSet::count sees through the first operand of constant exprs
+        if (ce->getOperand(0) == V) {
+          propagateToUsers(ce);
         }
       }
-    } while (changed);
+    }
+  }
+  // every value is propagated once, when it becomes sensitive: to itself
+  // if it is an instruction and to the instructions using it.  nothing
+  // else can make the rule fire for an instruction, so this reaches the
+  // same fixpoint as sweeping every function until nothing changes
+  void propagateSensitivity() {
+    auto& pending = sensitiveSet.pending;
+    while (!pending.empty()) {
+      auto V = pending.back();
+      pending.pop_back();
+      if (auto I = dyn_cast<Instruction>(V)) {
+        if (I->getParent() && !isWhiteListed(*I->getFunction())) {
+          propagateThrough(I);
+        }
+        if (auto call = dyn_cast<CallInst>(I)) {
+          markCallDirty(call);
+        }
+      } else if (auto arg = dyn_cast<Argument>(V)) {
+        summaryChanged(arg->getParent());
+      } else if (auto F = dyn_cast<Function>(V)) {
+        summaryChanged(F);
+      }
+      propagateToUsers(V);
+    }
+  }
+  // a function that wasn't analyzed yet (a clone) may use values that
+  // were propagated before it existed, so look at all of it once
+  void propagateSensitivity(Function& F) {
+    for (inst_iterator It = inst_begin(&F), Ie = inst_end(&F); It != Ie; ++It) {
+      propagateThrough(&*It);
+    }
+    propagateSensitivity();
   }
   void propagateSensitivity(Module& M) {
     for (auto& F : M) {
       if (!isWhiteListed(F)) {
-        //dbgs() << "scanning: " << F.getName() << "\n";
-        propagateSensitivity(F);
-        //sensitiveSet.dump();
+        for (inst_iterator It = inst_begin(&F), Ie = inst_end(&F); It != Ie; ++It) {
+          propagateThrough(&*It);
+        }
       }
     }
+    propagateSensitivity();
   }
   void makeReturnsSensitive(Function* F) {
     for (inst_iterator It = inst_begin(F), Ie = inst_end(F); It != Ie;) {
@@ -1781,14 +2355,13 @@ class SensitivityAnalysis {
         }
       }
       auto newName = origName.str() + suffix.str();
-      auto newFn = duplicateFunction(M, *origFn, newName);
+      auto newFn = makeClone(*origFn, newName);
       if (sensitivity[0] == 1) {
         makeReturnsSensitive(newFn);
       }
       for (unsigned i = 1; i < sensitivity.size(); ++i) {
         makeNthArgSensitive(*newFn, i-1);
       }
-      newFunctions.insert(newFn);
       return newFn;
     }
     return nullptr;
@@ -1825,11 +2398,179 @@ class SensitivityAnalysis {
         sensitiveSet.insert(i);
       }
     }
-    propagateSensitivity(*fn);
+    propagateSensitivity();
+  }
+
+  // the interprocedural part looks at direct calls to functions with a
+  // body.  what a call needs only depends on the call's own operands and on
+  // the summary of its callee and of the callee's replacement, i.e. which
+  // of their arguments are sensitive and whether they return something
+  // sensitive.  so a call is only looked at again when one of those changes
+  DenseMap<CallInst*, size_t> callIndex; // into callInfos.data
+  DenseMap<Function*, vector<size_t>> callsTo; // by callee and replacement
+  // position of each function in a top-down walk of the call graph's
+  // SCCs, clones share the position of their original
+  DenseMap<Function*, unsigned> sccRank;
+  // call sites to look at, by the rank of the calling function
+  set<pair<unsigned, size_t>> dirtyCalls;
+
+  void rankFunctions() {
+    CallGraph CG(M);
+    unsigned nSCCs = 0;
+    for (auto scc = scc_begin(&CG); !scc.isAtEnd(); ++scc, ++nSCCs) {
+      for (auto node : *scc) {
+        if (auto F = node->getFunction()) {
+          sccRank[F] = nSCCs;
+        }
+      }
+    }
+    for (auto& rank : sccRank) {
+      rank.second = nSCCs - 1 - rank.second;
+    }
+  }
+  void markCallDirty(size_t idx) {
+    dirtyCalls.insert({sccRank.lookup(&callInfos.data[idx].parent), idx});
+  }
+  void markCallDirty(CallInst* call) {
+    auto it = callIndex.find(call);
+    if (it != callIndex.end()) {
+      markCallDirty(it->second);
+    }
+  }
+  void summaryChanged(Function* F) {
+    auto it = callsTo.find(F);
+    if (it == callsTo.end()) { return; }
+    for (auto idx : it->second) {
+      markCallDirty(idx);
+    }
+  }
+  // starts tracking the call infos from first on
+  void indexCalls(size_t first) {
+    for (size_t idx = first, e = callInfos.data.size(); idx != e; ++idx) {
+      auto& acall = callInfos.data[idx];
+      if (acall.isDirectCall() && !acall.isCallToExternalFunction()) {
+        callIndex[&acall.callSite] = idx;
+        callsTo[acall.getCallee()].push_back(idx);
+        markCallDirty(idx);
+      }
+    }
+  }
+  void setReplacement(size_t idx, Function* F) {
+    auto& acall = callInfos.data[idx];
+    if (acall.replacement != F) {
+      acall.replacement = F;
+      callsTo[F].push_back(idx);
+    }
+  }
+  Function* makeClone(Function& F, StringRef name) {
+    auto newF = duplicateFunction(M, F, name);
+    auto size = countInstructions(*newF);
+    clones[name] = newF;
+    newFunctions.insert(newF);
+    sccRank[newF] = sccRank.lookup(&F);
+    clonedInstructions += size;
+    ++NumClones;
+    NumClonedInstructions += size;
+    return newF;
+  }
+  bool overCloneBudget(Function& F) {
+    if (!CloneBudget) { return false; }
+    return (clonedInstructions + countInstructions(F)) * 100 > moduleInstructions * CloneBudget;
+  }
+  // the signature of a call to F that makes everything sensitive
+  string allSensitiveName(CallInfo& acall) {
+    return acall.getCallee()->getName().str() + "_" + (acall.getReturnType()->isVoidTy() ? "0" : "1")
+           + "_" + string(acall.getNumArgs(), '1');
+  }
+  void analyzeCall(size_t idx) {
+    ++NumCallSiteVisits;
+    auto& acall = callInfos.data[idx];
+    DEBUG(dbgs() << "do we need a new function for: " << acall.getCallee()->getName() << "\n");
+    if (!acall.needsNewFunction()) {
+      DEBUG(dbgs() << "no\n");
+      return;
+    }
+    DEBUG(dbgs() << "yes\n");
+    DEBUG(dbgs() << "duplicating: " << acall.getCallee()->getName() + acall.getSignatureString() << "\n");
+    auto newName = acall.getCallee()->getName().str() + acall.getSignatureString();
+    auto existingF = clones.lookup(newName);
+    bool merged = false;
+    if (!existingF && overCloneBudget(*acall.getCallee())) {
+      // past the budget, signatures that didn't get a clone of their own
+      // yet share one that takes and returns everything sensitive.  that
+      // is always safe, the caller only ends up with more sensitive values
+      DEBUG(dbgs() << "over the clone budget\n");
+      ++NumCallsToMergedClones;
+      merged = true;
+      newName = allSensitiveName(acall);
+      existingF = clones.lookup(newName);
+      if (!acall.getReturnType()->isVoidTy()) {
+        sensitiveSet.insert(&acall.callSite);
+      }
+    }
+    if (existingF) {
+      DEBUG(dbgs() << "we already had it\n");
+      setReplacement(idx, existingF); // we already cloned the appropriate function
+      propagateAcrossCallBoundary(existingF, acall);
+      propagateSensitivity();
+      return;
+    }
+    DEBUG(dbgs() << "made new function\n");
+    auto newF = makeClone(*acall.getCallee(), newName);
+    setReplacement(idx, newF);
+    if (merged) {
+      for (auto& arg : newF->args()) {
+        sensitiveSet.insert(&arg);
+      }
+    }
+    DEBUG(dbgs() << newF->getName() << "\n");
+    if (UseMbedtlsAnnotations && newName == "x509_crt_verify_top_0_11111000") {
+      makeNamedVarSensitiveInFunction("hash", "x509_crt_verify_top_0_11111000");
+    }
+    if (UseMbedtlsAnnotations && newName == "x509_crt_verify_top_1_11111111") {
+      makeNamedVarSensitiveInFunction("hash", "x509_crt_verify_top_1_11111111");
+    }
+    propagateAcrossCallBoundary(newF, acall);
+    propagateSensitivity(*newF);
+    sensitiveSet.findSensitiveTypedValues(*newF);
+    propagateSensitivity();
+    // this may move callInfos.data, acall is stale from here on
+    auto first = callInfos.data.size();
+    callInfos.makeCallInfoForEachCallInst(*newF, sensitiveSet, sensitiveTypes);
+    indexCalls(first);
+  }
+  // looks at the dirty calls top-down through the call graph, then
+  // bottom-up, and so on.  sensitivity that flows from callers into
+  // callees is mostly settled in one direction, sensitivity that flows
+  // back out of callees in the other one
+  void analyzeCalls() {
+    bool topDown = true;
+    pair<unsigned, size_t> cursor(0, 0);
+    while (!dirtyCalls.empty()) {
+      auto it = topDown ? dirtyCalls.lower_bound(cursor) : dirtyCalls.upper_bound(cursor);
+      if (topDown && it == dirtyCalls.end()) {
+        topDown = false;
+        cursor = *dirtyCalls.rbegin();
+        continue;
+      }
+      if (!topDown) {
+        if (it == dirtyCalls.begin()) {
+          topDown = true;
+          cursor = *dirtyCalls.begin();
+          continue;
+        }
+        --it;
+      }
+      cursor = *it;
+      dirtyCalls.erase(it);
+      analyzeCall(cursor.second);
+    }
   }
 
   public:
   set<Function*> newFunctions;
+  StringMap<Function*> clones; // by callee name and signature
+  size_t moduleInstructions = 0, clonedInstructions = 0;
   FunctionToGlobalMapTy functionToGlobalMap;
   Module& M;
   CallInfoContainer callInfos;
@@ -1838,6 +2579,9 @@ class SensitivityAnalysis {
   SensitivityAnalysis(Module& M) : M(M), callInfos(M, functionToGlobalMap), sensitiveTypes(M), sensitiveSet(M, sensitiveTypes) {}
   void analyzeModule() {
     sensitiveTypes.dump();
+    for (auto& F : M) {
+      moduleInstructions += countInstructions(F);
+    }
     //sensitiveSet.dump();
    
     if (UseMbedtlsAnnotations) {
@@ -1999,58 +2743,10 @@ class SensitivityAnalysis {
     }
 
     propagateSensitivity(M);
+    rankFunctions();
     callInfos.makeCallInfoForEachCallInst(M, sensitiveSet, sensitiveTypes);
-
-    vector<Function*> newFsThisLoop;
-    do {
-      sensitiveSet.isChanged = false;
-      newFsThisLoop.clear();
-      propagateSensitivity(M);
-      for (auto& acall : callInfos.data) {
-        if (acall.isDirectCall() && !acall.isCallToExternalFunction()) {
-          DEBUG(dbgs() << "do we need a new function for: " << acall.getCallee()->getName() << "\n");
-          if (acall.needsNewFunction()) {
-            DEBUG(dbgs() << "yes\n");
-          } else {
-            DEBUG(dbgs() << "no\n");
-          }
-        }
-        if (acall.needsNewFunction() && acall.isDirectCall() && !acall.isCallToExternalFunction()) {
-          DEBUG(dbgs() << "duplicating: " << acall.getCallee()->getName() + acall.getSignatureString() << "\n");
-          auto newName = acall.getCallee()->getName().str() + acall.getSignatureString();
-          if (auto existingF = findFunctionWithSameName(newFunctions, newName)) {
-            DEBUG(dbgs() << "we already had it\n");
-            //if (acall.replacement != existingF) {
-              acall.replacement = existingF; // we already cloned the appropriate function
-              propagateAcrossCallBoundary(existingF, acall);
-              propagateSensitivity(acall.parent);
-            //}
-          } else {
-            DEBUG(dbgs() << "made new function\n");
-            auto newF = duplicateFunction(M, *acall.getCallee(), newName);
-            acall.replacement = newF;
-            //replacedFunctions.insert(acall.getCallee());
-            DEBUG(dbgs() << newF->getName() << "\n");
-            if (UseMbedtlsAnnotations && newName == "x509_crt_verify_top_0_11111000") {
-              makeNamedVarSensitiveInFunction("hash", "x509_crt_verify_top_0_11111000");
-            }
-            if (UseMbedtlsAnnotations && newName == "x509_crt_verify_top_1_11111111") {
-              makeNamedVarSensitiveInFunction("hash", "x509_crt_verify_top_1_11111111");
-            }
-            propagateAcrossCallBoundary(newF, acall);
-            propagateSensitivity(*newF);
-            propagateSensitivity(acall.parent);
-            newFsThisLoop.push_back(newF);
-            newFunctions.insert(newF);
-          }
-        } 
-      }
-      for (auto newF : newFsThisLoop) {
-        sensitiveSet.findSensitiveTypedValues(*newF);
-        propagateSensitivity(*newF);
-        callInfos.makeCallInfoForEachCallInst(*newF, sensitiveSet, sensitiveTypes);
-      }
-    } while (sensitiveSet.isChanged);
+    indexCalls(0);
+    analyzeCalls();
 
     if (UseMbedtlsAnnotations) {
       doTLSPRFhack();
@@ -2078,9 +2774,26 @@ class BoundsAnalysis {
   const ValueSet& sensitiveSet;
   Function *setBoundsDebug, *getBoundsDebug, *setFnArgBoundsDebug, *getFnArgBoundsDebug, *abortDebug;
   Function *setBounds, *getBounds, *setFnArgBounds, *getFnArgBounds, *abortFn, *dsSafeCopyArgv;
+  GlobalVariable *fnArgs;
   Constant* infiniteBounds;
   Constant* emptyBounds;
+  Constant* unsafeRegionBounds;
+  // marks the table lookups behind the low-fat bounds, see createLowFatBounds
+  StringRef lowFatMDString = "datashield.lowfat";
+  MDNode* lowFatMD;
+  // {pointer address, bounds} for the pointers in sensitive globals'
+  // initializers, see emitGlobalBoundsTable
+  vector<Constant*> globalBoundsEntries;
+  StructType* globalBoundsEntryTy;
   BoundsMap globalBoundsMap;
+  // sizes of sensitive allocations with a constant size, in bytes
+  map<Value*, uint64_t> staticAllocationSizes;
+  // functions that get their bounds in registers.  for each argument
+  // the operand number of its bounds or -1 for non pointer arguments
+  map<Function*, vector<int>> boundsOperands;
+  map<Argument*, Argument*> boundsArguments;
+  // returned pointer and the slot for its bounds
+  map<ReturnInst*, pair<Value*, InsertValueInst*>> boundsReturns;
   void getRuntimeFunctions() {
 
     // debug versions
@@ -2125,9 +2838,195 @@ class BoundsAnalysis {
     abortFn = dyn_cast<Function>(M.getOrInsertFunction("__ds_abort", abortTy));
     assert(abortFn && "should be able to get runtime functions");
 
+    // let the optimizer treat the fail blocks as dead ends
+    for (auto fn : {abortFn, abortDebug}) {
+      fn->setDoesNotReturn();
+      fn->setDoesNotThrow();
+      fn->addFnAttr(Attribute::Cold);
+    }
+
     auto dsCopyArgvTy = FunctionType::get(int8PtrPtrTy, {int32Ty, int8PtrPtrTy}, false);
     dsSafeCopyArgv = dyn_cast<Function>(M.getOrInsertFunction("__ds_copy_argv_to_safe_heap", dsCopyArgvTy));
     assert(dsSafeCopyArgv && "should be able to get rt functions");
+
+    // whatever stays a call should at least be transparent to the optimizer
+    getBounds->setOnlyReadsMemory();
+    for (auto fn : {getBounds, setBounds, getFnArgBounds, setFnArgBounds}) {
+      fn->setDoesNotThrow();
+    }
+
+    // the runtime's argument bounds, used when the fast paths are emitted
+    // inline.  each thread has its own argument bounds array in the safe region
+    fnArgs = dyn_cast<GlobalVariable>(M.getOrInsertGlobal("__ds_fn_args", boundsTy->getPointerTo()));
+    assert(fnArgs && "should be able to get the fn args array");
+    fnArgs->setThreadLocalMode(GlobalValue::InitialExecTLSModel);
+  }
+  bool shouldInlineRuntime() {
+    // prefixed/late mpx functions get every memory access rewritten
+    // at code emission, including our own table accesses
+    return InlineRuntime && !UsePrefix;
+  }
+  Value* getTableEntryAddress(IRBuilder<>& IRB, Value* ptrAddr) {
+    // the IR version of __ds_hash.  the table is mapped at a fixed
+    // address and indexed from RTSafeOrigin, so this folds to a mask and
+    // an add without loading anything
+    auto table = ConstantExpr::getIntToPtr(IRB.getInt64(RTMetadataTable), int64Ty->getPointerTo());
+    auto ptrInt = IRB.CreatePtrToInt(ptrAddr, int64Ty);
+    auto idx = IRB.CreateLShr(IRB.CreateSub(ptrInt, IRB.getInt64(RTSafeOrigin)), 3, "ds_hash");
+    return IRB.CreateInBoundsGEP(int64Ty, table, idx, "ds_table_entry");
+  }
+  // the table holds compact bounds, see __ds_encode_bounds in the runtime:
+  // the base's offset from RTSafeOrigin in the low half and the size in the
+  // high half, with a size of RTEscapeSize for the unsafe region (offset 0)
+  // and everything above it (offset 1)
+  Value* encodeBounds(IRBuilder<>& IRB, Value* bounds) {
+    auto base = IRB.CreatePtrToInt(IRB.CreateExtractValue(bounds, {0}), int64Ty);
+    auto last = IRB.CreatePtrToInt(IRB.CreateExtractValue(bounds, {1}), int64Ty);
+    auto lowHalf = IRB.getInt64(0xffffffffull);
+    auto escapeUnsafe = IRB.getInt64(RTEscapeSize << 32);
+    auto escapeAll = IRB.getInt64((RTEscapeSize << 32) | 1);
+    auto size = IRB.CreateAdd(IRB.CreateSub(last, base), IRB.getInt64(1));
+    auto compact = IRB.CreateOr(IRB.CreateShl(size, 32), IRB.CreateAnd(base, lowHalf));
+    auto high = IRB.CreateLShr(base, 32);
+    auto belowOrigin = IRB.CreateSelect(IRB.CreateICmpEQ(last, IRB.getInt64(0)),
+                                        IRB.getInt64(0), escapeUnsafe);
+    auto entry = IRB.CreateSelect(IRB.CreateICmpEQ(high, IRB.getInt64(0)), belowOrigin, escapeAll);
+    entry = IRB.CreateSelect(IRB.CreateICmpEQ(high, IRB.getInt64(1)), compact, entry);
+    return IRB.CreateSelect(IRB.CreateICmpEQ(last, IRB.getInt64(~0ull)), escapeAll, entry, "ds_compact_bounds");
+  }
+  Value* decodeBounds(IRBuilder<>& IRB, Value* entry, const Twine& name) {
+    auto offset = IRB.CreateAnd(entry, IRB.getInt64(0xffffffffull));
+    auto size = IRB.CreateLShr(entry, 32);
+    auto base = IRB.CreateOr(offset, IRB.getInt64(RTSafeOrigin));
+    // an empty entry decodes to last < base, which fails every check
+    auto last = IRB.CreateSub(IRB.CreateAdd(base, size), IRB.getInt64(1));
+    auto isEscape = IRB.CreateICmpEQ(size, IRB.getInt64(RTEscapeSize));
+    auto escapeBase = IRB.CreateShl(offset, 32);
+    auto escapeLast = IRB.CreateOr(IRB.CreateShl(IRB.CreateNeg(offset), 32), IRB.getInt64(0xffffffffull));
+    base = IRB.CreateSelect(isEscape, escapeBase, base);
+    last = IRB.CreateSelect(isEscape, escapeLast, last);
+    Value* bounds = UndefValue::get(boundsTy);
+    bounds = IRB.CreateInsertValue(bounds, IRB.CreateIntToPtr(base, int8PtrTy), {0});
+    return IRB.CreateInsertValue(bounds, IRB.CreateIntToPtr(last, int8PtrTy), {1}, name);
+  }
+  bool shouldUseLowFatBounds() {
+    // debug mode wants every lookup logged
+    return LowFatBounds && !DebugMode;
+  }
+  // bounds of ptr, loaded from ptrAddr.  pointers into the low-fat classes
+  // get the slot they point into, see lowfat.h in the runtime, anything else
+  // goes to the table.  the table lookup is a marked runtime call for now,
+  // guardTableLookups moves it behind a branch once the function is done
+  Value* createLowFatBounds(IRBuilder<>& IRB, Value* ptr, Value* ptrAddr, const Twine& name) {
+    auto ptrInt = IRB.CreatePtrToInt(ptr, int64Ty);
+    auto offset = IRB.CreateSub(ptrInt, IRB.getInt64(RTLowFatBase));
+    auto isLowFat = IRB.CreateICmpULT(offset, IRB.getInt64(RTLowFatSize), "ds_is_lowfat");
+    auto size = IRB.CreateShl(IRB.getInt64(RTLowFatMinSize), IRB.CreateLShr(offset, RTLowFatAreaShift));
+    auto base = IRB.CreateAnd(ptrInt, IRB.CreateNeg(size));
+    auto last = IRB.CreateSub(IRB.CreateAdd(base, size), IRB.getInt64(1));
+    Value* lowFatBounds = UndefValue::get(boundsTy);
+    lowFatBounds = IRB.CreateInsertValue(lowFatBounds, IRB.CreateIntToPtr(base, int8PtrTy), {0});
+    lowFatBounds = IRB.CreateInsertValue(lowFatBounds, IRB.CreateIntToPtr(last, int8PtrTy), {1});
+    auto tableBounds = IRB.CreateCall(getBounds, {IRB.CreateBitCast(ptrAddr, int8PtrTy)});
+    tableBounds->setMetadata(lowFatMDString, lowFatMD);
+    return IRB.CreateSelect(isLowFat, lowFatBounds, tableBounds, name);
+  }
+  // the low-fat bounds come from where a pointer points when it is loaded,
+  // not from the object it was derived from.  a pointer moved into the next
+  // slot of its class would come back with the neighbour's bounds, so a
+  // pointer into the low-fat classes may only be stored while it is still
+  // in the slot its own bounds start in.  pointers with infinite bounds
+  // have nothing to lose and aren't checked
+  void insertLowFatStoreCheck(StoreInst* store, Value* bounds) {
+    if (bounds == infiniteBounds) { return; }
+    IRBuilder<> IRB(store);
+    auto val = store->getValueOperand();
+    auto ptrInt = val->getType()->isPointerTy() ? IRB.CreatePtrToInt(val, int64Ty) : val;
+    auto offset = IRB.CreateSub(ptrInt, IRB.getInt64(RTLowFatBase));
+    auto isLowFat = IRB.CreateICmpULT(offset, IRB.getInt64(RTLowFatSize));
+    auto slotMask = IRB.CreateNeg(IRB.CreateShl(IRB.getInt64(RTLowFatMinSize), IRB.CreateLShr(offset, RTLowFatAreaShift)));
+    auto base = IRB.CreatePtrToInt(IRB.CreateExtractValue(bounds, 0), int64Ty);
+    auto last = IRB.CreatePtrToInt(IRB.CreateExtractValue(bounds, 1), int64Ty);
+    auto otherSlot = IRB.CreateICmpNE(IRB.CreateAnd(ptrInt, slotMask), IRB.CreateAnd(base, slotMask));
+    auto isFinite = IRB.CreateICmpNE(last, IRB.getInt64(~0ull));
+    auto escapes = IRB.CreateAnd(isLowFat, IRB.CreateAnd(isFinite, otherSlot), "ds_lowfat_escape");
+    auto failTerm = SplitBlockAndInsertIfThen(escapes, store, false);
+    failTerm->getParent()->setName("lowfat_fail");
+    IRBuilder<> failBuilder(failTerm);
+    failBuilder.CreateCall(abortFn, {});
+    NumLowFatStoreChecks++;
+  }
+  // turn select(isLowFat, lowFatBounds, table lookup) into a branch so the
+  // table is only read for pointers outside the low-fat classes.  done last
+  // because the checks and the loop versioning split and clone blocks
+  void guardTableLookups(Function& F) {
+    vector<CallInst*> lookups;
+    for (inst_iterator It = inst_begin(&F), Ie = inst_end(&F); It != Ie; ++It) {
+      if (It->getMetadata(lowFatMDString)) {
+        lookups.push_back(cast<CallInst>(&*It));
+      }
+    }
+    for (auto call : lookups) {
+      auto sel = cast<SelectInst>(call->getNextNode());
+      assert(call->hasOneUse() && *call->user_begin() == sel && "table lookup should feed the low-fat select");
+      auto origBB = call->getParent();
+      auto lookupBB = origBB->splitBasicBlock(call, "ds_table_lookup");
+      auto contBB = lookupBB->splitBasicBlock(sel, "ds_lowfat_cont");
+      auto uncond = origBB->getTerminator();
+      BranchInst::Create(contBB, lookupBB, sel->getCondition(), uncond);
+      uncond->eraseFromParent();
+
+      IRBuilder<> lookupBuilder(call);
+      auto tableBounds = createGetBounds(lookupBuilder, call->getArgOperand(0), "ds_table_bounds");
+      call->replaceAllUsesWith(tableBounds);
+      call->eraseFromParent();
+
+      auto phi = PHINode::Create(boundsTy, 2, "", sel);
+      phi->addIncoming(sel->getTrueValue(), origBB);
+      phi->addIncoming(tableBounds, lookupBB);
+      phi->takeName(sel);
+      sel->replaceAllUsesWith(phi);
+      sel->eraseFromParent();
+    }
+  }
+  Value* createGetBounds(IRBuilder<>& IRB, Value* ptrAddr, const Twine& name) {
+    auto ptrCasted = IRB.CreateBitCast(ptrAddr, int8PtrTy);
+    if (shouldInlineRuntime()) {
+      auto entry = IRB.CreateLoad(getTableEntryAddress(IRB, ptrCasted), "ds_table_load");
+      return decodeBounds(IRB, entry, name);
+    }
+    return IRB.CreateCall(getBounds, {ptrCasted}, name);
+  }
+  void createSetBounds(IRBuilder<>& IRB, Value* ptrAddr, Value* bounds) {
+    auto ptrCasted = IRB.CreateBitCast(ptrAddr, int8PtrTy);
+    if (shouldInlineRuntime()) {
+      IRB.CreateStore(encodeBounds(IRB, bounds), getTableEntryAddress(IRB, ptrCasted));
+    } else {
+      IRB.CreateCall(setBounds, {ptrCasted, bounds});
+    }
+  }
+  Value* getFnArgEntryAddress(IRBuilder<>& IRB, uint64_t index) {
+    assert(index < RTNumArgEntries && "too many pointer arguments for the fn args array");
+    auto array = IRB.CreateLoad(fnArgs, "ds_fn_args");
+    return IRB.CreateConstInBoundsGEP1_64(array, index, "ds_fn_arg_entry");
+  }
+  Value* createGetFnArgBounds(IRBuilder<>& IRB, uint64_t index, const Twine& name) {
+    if (shouldInlineRuntime()) {
+      // like __ds_get_fn_arg_bounds, reset the entry to the unsafe region
+      // so a stale entry can't be picked up by the next callee
+      auto entry = getFnArgEntryAddress(IRB, index);
+      auto bounds = IRB.CreateLoad(entry, name);
+      IRB.CreateStore(unsafeRegionBounds, entry);
+      return bounds;
+    }
+    return IRB.CreateCall(getFnArgBounds, {IRB.getInt64(index)}, name);
+  }
+  void createSetFnArgBounds(IRBuilder<>& IRB, uint64_t index, Value* bounds) {
+    if (shouldInlineRuntime()) {
+      IRB.CreateStore(bounds, getFnArgEntryAddress(IRB, index));
+    } else {
+      IRB.CreateCall(setFnArgBounds, {IRB.getInt64(index), bounds});
+    }
   }
   void searchForGlobalsIn(Constant* curr, IRBuilder<>& IRB, Value* dbgStr, DataLayout& DL, set<Value*>& visited, Value* ptrAddr = nullptr) {
       if (visited.count(curr)) { return; }
@@ -2262,13 +3161,33 @@ class BoundsAnalysis {
     } else {
       return; // don't store bounds for other things like scalars
     }
-    auto id = ConstantInt::get(int64Ty, IDCounter++);
     if (DebugMode) {
+      auto id = ConstantInt::get(int64Ty, IDCounter++);
       IRB.CreateCall(setBoundsDebug, {ptrAddr, bounds, dbgStr, id});
+    } else if (isa<Constant>(ptrAddr) && isa<Constant>(bounds)) {
+      auto ptrAddrCasted = ConstantExpr::getPointerCast(cast<Constant>(ptrAddr), int8PtrTy);
+      globalBoundsEntries.push_back(ConstantStruct::get(globalBoundsEntryTy, ptrAddrCasted,
+                                                        cast<Constant>(bounds), NULL));
     } else {
-      IRB.CreateCall(setBounds, {ptrAddr, bounds});
+      createSetBounds(IRB, ptrAddr, bounds);
     }
   }
+  // the runtime copies everything in the __ds_global_bounds section into
+  // the table in __ds_init, so the bounds of the globals cost no code and
+  // are there before any constructor runs
+  void emitGlobalBoundsTable() {
+    if (globalBoundsEntries.empty()) {
+      return;
+    }
+    auto tableTy = ArrayType::get(globalBoundsEntryTy, globalBoundsEntries.size());
+    // not constant, a read only section would need text relocations in pies
+    auto table = new GlobalVariable(M, tableTy, false, GlobalValue::InternalLinkage,
+                                    ConstantArray::get(tableTy, globalBoundsEntries),
+                                    "__ds_global_bounds_table");
+    table->setSection("__ds_global_bounds");
+    table->setAlignment(8);
+    addToUsed(M, table);
+  }
   void lookForBoundsInInitializer(GlobalVariable* global, IRBuilder<>& IRB, Value* dbgStr, DataLayout& DL, set<Value*>& visited, Value* ptrAddr = nullptr) {
     if (global->hasInitializer()) {
       auto init = global->getInitializer();
@@ -2283,6 +3202,7 @@ class BoundsAnalysis {
 
     set<Value*> visited;
     auto DL = M.getDataLayout();
+    globalBoundsEntryTy = StructType::get(int8PtrTy, boundsTy, NULL);
     auto globalBoundsInitFnTy = FunctionType::get(voidTy, {}, false);
     auto globalBoundsInitFn = dyn_cast<Function>(M.getOrInsertFunction("__ds_init_global_bounds", globalBoundsInitFnTy));
     assert(globalBoundsInitFn && "should be able to create global bounds init funciton");
@@ -2290,7 +3210,10 @@ class BoundsAnalysis {
 
     IRBuilder<> IRB(entry);
 
-    auto dbgStr = getGlobalString(IRB, "globals init function");
+    Value* dbgStr = nullptr;
+    if (DebugMode) {
+      dbgStr = getGlobalString(IRB, "globals init function");
+    }
 
     dbgs() << "begin createGlobalBounds\n";
     for (auto& g : M.globals()) {
@@ -2304,6 +3227,12 @@ class BoundsAnalysis {
       }
     }
     dbgs() << "end createGlobalBounds\n";
+    emitGlobalBoundsTable();
+    // only debug mode and bounds that didn't fold to constants need code
+    if (entry->empty()) {
+      globalBoundsInitFn->eraseFromParent();
+      return;
+    }
     IRB.CreateRetVoid();
     appendToGlobalCtors(M, globalBoundsInitFn, 99999);
   }
@@ -2324,8 +3253,7 @@ class BoundsAnalysis {
             auto argv = &*orig_main->arg_begin()++;
             if (sensitiveSet.count(argv)) {
               auto bounds = infiniteBounds; // FIX ME
-              auto two = ConstantInt::get(int64Ty, 2);
-              IRB.CreateCall(setFnArgBounds, {two, bounds});
+              createSetFnArgBounds(IRB, 2, bounds);
               auto newArgv = IRB.CreateCall(dsSafeCopyArgv, {mainCall->getArgOperand(0), mainCall->getArgOperand(1)});
               mainCall->replaceUsesOfWith(mainCall->getArgOperand(1), newArgv);
             }
@@ -2395,13 +3323,17 @@ class BoundsAnalysis {
       // load the bounds immediatelly following the call
       IRBuilder<> IRB(call->getNextNode());
       Bounds* bounds = nullptr;
+      if (calledF && boundsOperands.count(calledF) && call->getType()->isStructTy()) {
+        bounds = IRB.CreateExtractValue(call, 1, boundsName);
+        boundsMap[call] = bounds;
+        return bounds;
+      }
       if (DebugMode) {
         auto id = ConstantInt::get(int64Ty, IDCounter++);
         bounds = IRB.CreateCall(getFnArgBoundsDebug,
         {ConstantInt::get(int64Ty, 0), DebugString, id}, boundsName);
       } else {
-        bounds = IRB.CreateCall(getFnArgBounds,
-        {ConstantInt::get(int64Ty, 0)}, boundsName);
+        bounds = createGetFnArgBounds(IRB, 0, boundsName);
       }
       boundsMap[call] = bounds;
       NumBoundsLoads++;
@@ -2449,8 +3381,10 @@ class BoundsAnalysis {
       if (DebugMode) {
         auto id = ConstantInt::get(int64Ty, IDCounter++);
         bounds = IRB.CreateCall(getBoundsDebug, {baseCasted, DebugString, id}, boundsName);
+      } else if (shouldUseLowFatBounds() && load->getType()->isPointerTy()) {
+        bounds = createLowFatBounds(IRB, load, baseCasted, boundsName);
       } else {
-        bounds = IRB.CreateCall(getBounds, {baseCasted}, boundsName);
+        bounds = createGetBounds(IRB, baseCasted, boundsName);
       }
       NumBoundsLoads++;
       boundsMap[load] = bounds;
@@ -2461,6 +3395,10 @@ class BoundsAnalysis {
       if (boundsMap[argu]) {
         return boundsMap[argu];
       }
+      if (boundsArguments.count(argu)) {
+        boundsMap[argu] = boundsArguments[argu];
+        return boundsMap[argu];
+      }
       IRBuilder<> IRB(&*insertionPoint->getParent()->getParent()->getEntryBlock().getFirstInsertionPt());
       auto num = ConstantInt::get(int64Ty, argu->getArgNo()+1);
       Value* bounds = nullptr;
@@ -2468,7 +3406,7 @@ class BoundsAnalysis {
         auto id = ConstantInt::get(int64Ty, IDCounter++);
         bounds = IRB.CreateCall(getFnArgBoundsDebug, {num, DebugString, id}, boundsName);
       } else {
-        bounds = IRB.CreateCall(getFnArgBounds, {num}, boundsName);
+        bounds = createGetFnArgBounds(IRB, argu->getArgNo()+1, boundsName);
       }
       NumBoundsLoads++;
       boundsMap[argu] = bounds;
@@ -2523,6 +3461,9 @@ class BoundsAnalysis {
     if (isa<LoadInst>(target)) {
       return true;
     }
+    if (safeStackSlots.count(target)) {
+      return true;
+    }
     if (isa<CallInst>(target)) {
       //return getReturnValBounds(call);
       return true;
@@ -2655,7 +3596,7 @@ class BoundsAnalysis {
     if (DebugMode) {
       IRB.CreateCall(setFnArgBoundsDebug, {idx, bounds, debugStr});
     } else {
-      IRB.CreateCall(setFnArgBounds, {idx, bounds});
+      createSetFnArgBounds(IRB, index, bounds);
     }
     NumBoundsStores++;
   }
@@ -2666,7 +3607,7 @@ class BoundsAnalysis {
       auto id = ConstantInt::get(int64Ty, IDCounter++);
       IRB.CreateCall(setBoundsDebug, {ptrCasted, bounds, dbgStr, id});
     } else {
-      IRB.CreateCall(setBounds, {ptrCasted, bounds});
+      createSetBounds(IRB, ptrCasted, bounds);
     }
     NumBoundsStores++;
   }
@@ -2684,6 +3625,7 @@ class BoundsAnalysis {
     // 1) store a pointer
     // 2) pass a sensitive pointer to a function
     // 3) return a sensitive pointer
+    vector<pair<StoreInst*, Value*>> lowFatStores; // checked once the loop is done
 
     for (inst_iterator It = inst_begin(&F), Ie = inst_end(&F); It != Ie; ++It) {
       auto i = &*It;
@@ -2766,6 +3708,9 @@ class BoundsAnalysis {
           }
           auto ptrAddr = store->getPointerOperand();
           insertBoundsStore(bounds, ptrAddr, dbgStr, IRB);
+          if (shouldUseLowFatBounds()) {
+            lowFatStores.push_back({store, bounds});
+          }
         }
       }
       if (auto call = dyn_cast<CallInst>(i)) {
@@ -2794,13 +3739,23 @@ class BoundsAnalysis {
               dbgStr = getDebugString(IRB, call);
             }
             auto bounds = getOrLoadBounds(argu, boundsMap, TLI, dbgStr, call);
-            storeFnArg(IRB, bounds, i, dbgStr);
+            if (calledFn && boundsOperands.count(calledFn)) {
+              call->setArgOperand(boundsOperands[calledFn][i-1], bounds);
+            } else {
+              storeFnArg(IRB, bounds, i, dbgStr);
+            }
           }
           i++;
         }
       }
       if (auto ret = dyn_cast<ReturnInst>(i)) {
-        if (auto rv = ret->getReturnValue()) {
+        if (boundsReturns.count(ret)) {
+          auto rv = boundsReturns[ret].first;
+          if (sensitiveSet.count(rv) && couldHaveBounds(rv)) {
+            auto bounds = getOrLoadBounds(rv, boundsMap, TLI, nullptr, ret);
+            boundsReturns[ret].second->setOperand(1, bounds);
+          }
+        } else if (auto rv = ret->getReturnValue()) {
           if (sensitiveSet.count(rv) && couldHaveBounds(rv)) {
             IRBuilder<> IRB(ret);
             Value* dbgStr = nullptr;
@@ -2813,6 +3768,9 @@ class BoundsAnalysis {
         }
       }
     }
+    for (auto& lowFatStore : lowFatStores) {
+      insertLowFatStoreCheck(lowFatStore.first, lowFatStore.second);
+    }
   }
   bool isNullPointerPassedAsSensitive(CallInst& call, Value* argu, unsigned argNo) {
     if (!isa<ConstantPointerNull>(argu)) { return false; }
@@ -2826,6 +3784,9 @@ class BoundsAnalysis {
   }
 
   Value* getBasedOnValue(Value* target) {
+    if (safeStackSlots.count(target)) {
+      return target;
+    }
     // we want to find out how this value entered the current function scope,
     // i.e., was it:
     // loaded
@@ -3027,6 +3988,9 @@ class BoundsAnalysis {
       if (isa<AllocaInst>(i) && sensitiveSet.count(i)) {
         sensitiveAllocations.insert(i);
       }
+      if (safeStackSlots.count(i)) {
+        sensitiveAllocations.insert(i);
+      }
     }
   }
   void createBoundsForAllocations(const DataLayout& DL,
@@ -3034,6 +3998,13 @@ class BoundsAnalysis {
     BoundsMap& boundsMap) {
     for (auto alloc : sensitiveAllocations) {
       IRBuilder<> IRB(alloc->getNextNode());
+      if (safeStackSlots.count(alloc)) {
+        // slots are i8* so the bounds are in bytes
+        auto sz = safeStackSlots[alloc];
+        staticAllocationSizes[alloc] = sz;
+        boundsMap[alloc] = createBounds(IRB, alloc, ConstantInt::get(int64Ty, sz));
+        continue;
+      }
       if (auto mallc = dyn_cast<CallInst>(alloc)) {
         Value* sz = nullptr;
         auto fnName = mallc->getCalledFunction()->getName();
@@ -3055,6 +4026,9 @@ class BoundsAnalysis {
         } else {
           llvm_unreachable("mismatched allocation function name?");
         }
+        if (auto constSz = dyn_cast<ConstantInt>(sz)) {
+          staticAllocationSizes[mallc] = constSz->getZExtValue();
+        }
         auto bounds = createBounds(IRB, mallc, sz);
         boundsMap[mallc] = bounds;
         DCDBG("created bounds: ");
@@ -3076,6 +4050,9 @@ class BoundsAnalysis {
           auto typeSize = DL.getTypeAllocSize(alloca->getAllocatedType());
           auto typeSizeVal = ConstantInt::get(int32Ty, typeSize);
           Value* sz = IRB.CreateMul(nelements, typeSizeVal);
+          if (auto constSz = dyn_cast<ConstantInt>(sz)) {
+            staticAllocationSizes[alloca] = constSz->getZExtValue();
+          }
           auto bounds = createBounds(IRB, alloca, sz);
           boundsMap[alloca] = bounds;
           DCDBG("created bounds: ");
@@ -3109,8 +4086,18 @@ class BoundsAnalysis {
     return bounds;
   }
 
+  uint64_t getAccessSize(Value* ptr, const DataLayout& DL) {
+    auto ptrType = cast<PointerType>(ptr->getType());
+    auto eleType = ptrType->getElementType();
+    if (isa<FunctionType>(eleType)) {
+      return 1;
+    }
+    return DL.getTypeStoreSize(eleType);
+  }
+  // checks that [ptr + lowOffset, ptr + highOffset] is within bounds
   void insertInLineBoundsCheck(Function& F, Instruction* checkedInst,
-                                         Bounds* bounds, Value* ptr, Value* debugStr, const DataLayout& DL) {
+                                         Bounds* bounds, Value* ptr, Value* debugStr, const DataLayout& DL,
+                                         int64_t lowOffset, int64_t highOffset) {
 
     if (bounds == infiniteBounds) {
       return;
@@ -3131,15 +4118,7 @@ class BoundsAnalysis {
     auto uncond = --origEnd;
     IRBuilder<> origBuilder(&*uncond);
 
-    auto ptrType = cast<PointerType>(ptr->getType());
-    auto eleType = ptrType->getElementType();
-    uint64_t sz = 0;
-    if (isa<FunctionType>(eleType)) {
-      sz = 1;
-    } else {
-      sz = DL.getTypeStoreSize(eleType);
-    }
-    auto idx = cast<ConstantInt>(ConstantInt::get(int64Ty, sz-1));
+    auto idx = cast<ConstantInt>(ConstantInt::get(int64Ty, highOffset));
 
     if (DebugMode) {
       auto numBoundsChecksPtr = getOrCreateNumBoundsChecks(*F.getParent());
@@ -3150,6 +4129,10 @@ class BoundsAnalysis {
     }
 
     auto ptrCasted = origBuilder.CreateBitCast(ptr, int8PtrTy);
+    if (lowOffset != 0) {
+      ptrCasted = origBuilder.CreateGEP(ptrCasted, origBuilder.getInt64(lowOffset), ptr->getName() + "_top");
+      idx = cast<ConstantInt>(ConstantInt::get(int64Ty, highOffset - lowOffset));
+    }
     auto objectBottom = origBuilder.CreateGEP(ptrCasted, idx, ptr->getName() + "_bottom");
 
     auto base = origBuilder.CreateExtractValue(bounds, 0);
@@ -3187,6 +4170,396 @@ class BoundsAnalysis {
 
     return;
   }
+  bool shouldHoistLoopChecks() {
+    // debug mode wants every access logged
+    return LoopChecks && !DebugMode;
+  }
+  // a pointer induction variable gets a bounds phi in the loop header
+  // which only forwards the bounds coming from the preheader
+  Bounds* getLoopInvariantBounds(Bounds* bounds, Loop* L, DominatorTree& DT) {
+    auto inst = dyn_cast<Instruction>(bounds);
+    if (!inst) {
+      return bounds;
+    }
+    if (!L->contains(inst)) {
+      return DT.dominates(inst, L->getLoopPreheader()->getTerminator()) ? bounds : nullptr;
+    }
+    auto phi = dyn_cast<PHINode>(inst);
+    if (!phi || phi->getParent() != L->getHeader()) {
+      return nullptr;
+    }
+    Value* incoming = nullptr;
+    for (auto& inc : phi->incoming_values()) {
+      if (inc == phi) {
+        continue;
+      }
+      if (incoming && incoming != inc) {
+        return nullptr;
+      }
+      incoming = inc;
+    }
+    if (!incoming) {
+      return nullptr;
+    }
+    if (auto incInst = dyn_cast<Instruction>(incoming)) {
+      if (L->contains(incInst)) {
+        return nullptr;
+      }
+    }
+    return getLoopInvariantBounds(incoming, L, DT);
+  }
+  // an access at first + i*step for every i in [0, tripCount].  the
+  // range check bounds the trip count itself, since evaluating the last
+  // address in SCEV's modular arithmetic can wrap back into the object
+  struct LoopAccessRange {
+    Bounds* bounds;
+    const SCEV* first;
+    const SCEV* tripCount;
+    int64_t step;
+    uint64_t size;
+  };
+  // exactTripCount is false when only a maximum trip count is known
+  bool getLoopAccessRange(Value* ptr, Loop* L, ScalarEvolution& SE, const DataLayout& DL,
+                          LoopAccessRange& range, bool& exactTripCount) {
+    auto AR = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(ptr));
+    if (!AR || AR->getLoop() != L || !AR->isAffine()) {
+      return false;
+    }
+    auto step = dyn_cast<SCEVConstant>(AR->getStepRecurrence(SE));
+    if (!step || step->getValue()->isZero() || step->getAPInt().getMinSignedBits() > 64
+        || step->getAPInt().isMinSignedValue()) {
+      return false;
+    }
+    auto tripCount = SE.getBackedgeTakenCount(L);
+    exactTripCount = !isa<SCEVCouldNotCompute>(tripCount);
+    if (!exactTripCount) {
+      tripCount = SE.getMaxBackedgeTakenCount(L);
+      if (isa<SCEVCouldNotCompute>(tripCount)) {
+        return false;
+      }
+    }
+    if (SE.getTypeSizeInBits(tripCount->getType()) > 64) {
+      return false;
+    }
+    range.first = AR->getStart();
+    range.tripCount = SE.getNoopOrZeroExtend(tripCount, int64Ty);
+    range.step = step->getAPInt().getSExtValue();
+    range.size = getAccessSize(ptr, DL);
+    return SE.isLoopInvariant(range.first, L) && SE.isLoopInvariant(range.tripCount, L)
+      && isSafeToExpand(range.first, SE) && isSafeToExpand(range.tripCount, SE);
+  }
+  bool mayLeaveLoopEarly(Loop* L) {
+    for (auto BB : L->blocks()) {
+      for (auto& I : *BB) {
+        if (isa<InvokeInst>(&I)) {
+          return true;
+        }
+        if (auto call = dyn_cast<CallInst>(&I)) {
+          auto calledF = call->getCalledFunction();
+          if (!calledF || !(calledF->isIntrinsic() || calledF->getName().startswith("__ds"))) {
+            return true;
+          }
+        }
+      }
+    }
+    return false;
+  }
+  // true if inst runs on every iteration of L including the last one,
+  // so checking the whole range up front can't report a false positive
+  bool executesOnEveryIteration(Instruction* inst, Loop* L, DominatorTree& DT) {
+    auto BB = inst->getParent();
+    if (!DT.dominates(BB, L->getLoopLatch())) {
+      return false;
+    }
+    SmallVector<BasicBlock*, 4> exitingBlocks;
+    L->getExitingBlocks(exitingBlocks);
+    for (auto exiting : exitingBlocks) {
+      if (!DT.dominates(BB, exiting)) {
+        return false;
+      }
+    }
+    return !mayLeaveLoopEarly(L);
+  }
+  bool canVersionLoop(Loop* L) {
+    return L->isLoopSimplifyForm() && L->isSafeToClone()
+      && L->getExitingBlock() && L->getExitBlock();
+  }
+  // first and the last byte of its access lie in [base, last], and the
+  // trip count is at most the number of steps that fit between them and
+  // the end of the object in the step's direction.  everything is
+  // unsigned and the differences are only taken once they can't wrap
+  Value* createLoopRangeCheck(Instruction* insertionPoint, SCEVExpander& expander,
+                              vector<LoopAccessRange>& ranges) {
+    IRBuilder<> IRB(insertionPoint);
+    Value* inBounds = IRB.getTrue();
+    for (auto& range : ranges) {
+      auto first = expander.expandCodeFor(range.first, int64Ty, insertionPoint);
+      auto tripCount = expander.expandCodeFor(range.tripCount, int64Ty, insertionPoint);
+      auto base = IRB.CreatePtrToInt(IRB.CreateExtractValue(range.bounds, 0), int64Ty);
+      auto last = IRB.CreatePtrToInt(IRB.CreateExtractValue(range.bounds, 1), int64Ty);
+      auto lastByte = ConstantInt::get(int64Ty, range.size - 1);
+      inBounds = IRB.CreateAnd(IRB.CreateICmpUGE(first, base), inBounds);
+      inBounds = IRB.CreateAnd(IRB.CreateICmpULE(first, last), inBounds);
+      auto room = IRB.CreateSub(last, first);
+      inBounds = IRB.CreateAnd(IRB.CreateICmpUGE(room, lastByte), inBounds);
+      Value* steps;
+      if (range.step > 0) {
+        steps = IRB.CreateUDiv(IRB.CreateSub(room, lastByte), ConstantInt::get(int64Ty, range.step));
+      } else {
+        steps = IRB.CreateUDiv(IRB.CreateSub(first, base), ConstantInt::get(int64Ty, -range.step));
+      }
+      // the differences above are garbage if an earlier comparison failed,
+      // but then inBounds is already false
+      inBounds = IRB.CreateAnd(IRB.CreateICmpULE(tripCount, steps), inBounds);
+    }
+    return inBounds;
+  }
+  void insertPreheaderCheck(Function& F, Loop* L, Value* inBounds, DominatorTree& DT, LoopInfo& LI) {
+    auto checkBB = L->getLoopPreheader();
+    auto passBB = SplitBlock(checkBB, checkBB->getTerminator(), &DT, &LI);
+    BasicBlock* failBB = BasicBlock::Create(F.getParent()->getContext(), "loop_fail", &F);
+    IRBuilder<> failBuilder(failBB);
+    failBuilder.CreateCall(abortFn, {});
+    failBuilder.CreateBr(passBB);
+    DT.addNewBlock(failBB, checkBB);
+    if (auto parent = L->getParentLoop()) {
+      parent->addBasicBlockToLoop(failBB, LI);
+    }
+    auto uncond = checkBB->getTerminator();
+    BranchInst::Create(passBB, failBB, inBounds, uncond);
+    uncond->eraseFromParent();
+  }
+  // keeps L, without the per access checks, for when inBounds holds in the
+  // preheader and runs a clone of it, which keeps them, otherwise
+  void versionLoop(Loop* L, Value* inBounds, DominatorTree& DT, LoopInfo& LI,
+                   ScalarEvolution& SE, ValueToValueMapTy& VMap) {
+    formLCSSA(*L, DT, &LI, &SE);
+    auto checkBB = L->getLoopPreheader();
+    auto exitingBB = L->getExitingBlock();
+    auto exitBB = L->getExitBlock();
+    auto fastPH = SplitBlock(checkBB, checkBB->getTerminator(), &DT, &LI);
+
+    SmallVector<BasicBlock*, 8> checkedBlocks;
+    auto checkedLoop = cloneLoopWithPreheader(fastPH, checkBB, L, VMap, ".checked", &LI, &DT, checkedBlocks);
+    remapInstructionsInBlocks(checkedBlocks, VMap);
+
+    auto uncond = checkBB->getTerminator();
+    BranchInst::Create(fastPH, checkedLoop->getLoopPreheader(), inBounds, uncond);
+    uncond->eraseFromParent();
+
+    // both copies leave through the same exit, the lcssa phis there
+    // are the only users of values from inside the loop
+    auto checkedExitingBB = cast<BasicBlock>(VMap[exitingBB]);
+    for (auto& I : *exitBB) {
+      auto phi = dyn_cast<PHINode>(&I);
+      if (!phi) {
+        break;
+      }
+      auto inc = phi->getIncomingValueForBlock(exitingBB);
+      Value* checkedInc = VMap.lookup(inc);
+      phi->addIncoming(checkedInc ? checkedInc : inc, checkedExitingBB);
+    }
+    DT.changeImmediateDominator(exitBB, checkBB);
+    SE.forgetLoop(L);
+  }
+  // replace the per access checks of induction variable based accesses in
+  // innermost loops with one range check in the preheader. when the range
+  // is only an upper bound (unknown trip count, conditional access, calls
+  // that might not return) the loop is versioned instead: the range check
+  // picks between the unchecked loop and a copy that checks every access
+  void insertLoopBoundsChecks(Function& F, vector<Value*>& needsBounds, BoundsMap& boundsMap,
+                              const DataLayout& DL, const TargetLibraryInfo& TLI,
+                              set<Value*>& loopChecked) {
+    DominatorTree DT(F);
+    LoopInfo LI(DT);
+    AssumptionCache AC(F);
+    ScalarEvolution SE(F, const_cast<TargetLibraryInfo&>(TLI), AC, DT, LI);
+    SCEVExpander expander(SE, DL, "ds_loop_range");
+
+    MapVector<Loop*, vector<Instruction*>> loopAccesses;
+    for (auto val : needsBounds) {
+      auto inst = cast<Instruction>(val);
+      if (!isa<LoadInst>(inst) && !isa<StoreInst>(inst)) {
+        continue;
+      }
+      auto L = LI.getLoopFor(inst->getParent());
+      if (L && L->empty() && L->getLoopPreheader()) {
+        loopAccesses[L].push_back(inst);
+      }
+    }
+
+    for (auto& entry : loopAccesses) {
+      auto L = entry.first;
+      bool needsVersioning = false;
+      vector<LoopAccessRange> ranges;
+      vector<Instruction*> covered;
+      for (auto inst : entry.second) {
+        Value* ptrOp = nullptr;
+        if (auto load = dyn_cast<LoadInst>(inst)) {
+          ptrOp = load->getPointerOperand();
+        } else {
+          ptrOp = cast<StoreInst>(inst)->getPointerOperand();
+        }
+        if (isa<GlobalVariable>(ptrOp)) { continue; }
+        auto bounds = getOrLoadBounds(ptrOp, boundsMap, TLI, nullptr, inst);
+        if (bounds == infiniteBounds) { continue; }
+        bounds = getLoopInvariantBounds(bounds, L, DT);
+        if (!bounds) { continue; }
+
+        LoopAccessRange range;
+        range.bounds = bounds;
+        bool exactTripCount;
+        if (!getLoopAccessRange(ptrOp, L, SE, DL, range, exactTripCount)) { continue; }
+        if (!exactTripCount || !executesOnEveryIteration(inst, L, DT)) {
+          needsVersioning = true;
+        }
+
+        // accesses through the same induction variable share a check
+        bool duplicate = false;
+        for (auto& other : ranges) {
+          if (other.bounds == range.bounds && other.first == range.first && other.step == range.step
+              && other.tripCount == range.tripCount && other.size == range.size) {
+            duplicate = true;
+            break;
+          }
+        }
+        if (!duplicate) {
+          ranges.push_back(range);
+        }
+        covered.push_back(inst);
+      }
+      if (covered.empty() || (needsVersioning && !canVersionLoop(L))) {
+        continue;
+      }
+
+      DCDBG("checking " << covered.size() << " accesses once for loop: " << L->getHeader()->getName() << "\n");
+      auto inBounds = createLoopRangeCheck(L->getLoopPreheader()->getTerminator(), expander, ranges);
+      if (needsVersioning) {
+        ValueToValueMapTy VMap;
+        versionLoop(L, inBounds, DT, LI, SE, VMap);
+        // the checked copy needs bounds for its own values
+        vector<pair<Value*, Bounds*>> clonedBounds;
+        for (auto& kv : boundsMap) {
+          if (!kv.second) { continue; }
+          if (Value* cloned = VMap.lookup(kv.first)) {
+            Value* clonedB = VMap.lookup(kv.second);
+            clonedBounds.push_back(make_pair(cloned, clonedB ? clonedB : kv.second));
+          }
+        }
+        for (auto& kv : clonedBounds) {
+          boundsMap[kv.first] = kv.second;
+        }
+        auto numNeedsBounds = needsBounds.size();
+        for (size_t i = 0; i < numNeedsBounds; ++i) {
+          if (Value* cloned = VMap.lookup(needsBounds[i])) {
+            needsBounds.push_back(cloned);
+          }
+        }
+        NumVersionedLoops++;
+      } else {
+        insertPreheaderCheck(F, L, inBounds, DT, LI);
+      }
+      for (auto inst : covered) {
+        loopChecked.insert(inst);
+      }
+      NumLoopCheckedAccesses += covered.size();
+    }
+  }
+  // a pending check of the bytes [base + low, base + high], where
+  // the checked pointer itself is base + ptrOffset
+  struct BoundsCheck {
+    Instruction* inst;
+    Bounds* bounds;
+    Value* ptr;
+    Value* debugStr;
+    Value* base;
+    int64_t ptrOffset;
+    int64_t low;
+    int64_t high;
+  };
+  BoundsCheck makeBoundsCheck(Instruction* inst, Bounds* bounds, Value* ptr, Value* debugStr, const DataLayout& DL) {
+    int64_t offset = 0;
+    auto base = GetPointerBaseWithConstantOffset(ptr, offset, DL);
+    int64_t sz = getAccessSize(ptr, DL);
+    return BoundsCheck{inst, bounds, ptr, debugStr, base, offset, offset, offset + sz - 1};
+  }
+  // nothing between from and to can keep to from executing
+  bool alwaysReaches(Instruction* from, Instruction* to) {
+    if (from->getParent() != to->getParent()) {
+      return false;
+    }
+    for (auto I = from->getIterator(); &*I != to; ++I) {
+      if (!isGuaranteedToTransferExecutionToSuccessor(&*I)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  // a check is redundant if a dominating check of the same bounds already
+  // covered its range from the same base.  a dominating check that always
+  // reaches the later one is widened to cover it instead
+  void removeRedundantChecks(Function& F, vector<BoundsCheck>& checks) {
+    DominatorTree DT(F);
+    DT.updateDFSNumbers();
+    map<Instruction*, unsigned> order;
+    unsigned n = 0;
+    for (inst_iterator It = inst_begin(&F), Ie = inst_end(&F); It != Ie; ++It) {
+      order[&*It] = n++;
+    }
+
+    // visit the checks in dominator tree order so dominating checks come first
+    vector<size_t> visitOrder;
+    for (size_t i = 0; i < checks.size(); ++i) {
+      visitOrder.push_back(i);
+    }
+    auto dfsIn = [&](size_t i) { return DT.getNode(checks[i].inst->getParent())->getDFSNumIn(); };
+    stable_sort(visitOrder.begin(), visitOrder.end(), [&](size_t a, size_t b) {
+      if (dfsIn(a) != dfsIn(b)) {
+        return dfsIn(a) < dfsIn(b);
+      }
+      return order[checks[a].inst] < order[checks[b].inst];
+    });
+
+    map<pair<Value*, Bounds*>, vector<size_t>> kept;
+    vector<bool> redundant(checks.size(), false);
+    for (auto i : visitOrder) {
+      auto& check = checks[i];
+      if (check.bounds == infiniteBounds) {
+        continue;
+      }
+      auto& dominating = kept[make_pair(check.base, check.bounds)];
+      for (auto j = dominating.rbegin(), je = dominating.rend(); j != je; ++j) {
+        auto& prev = checks[*j];
+        if (!DT.dominates(prev.inst, check.inst)) {
+          continue;
+        }
+        if (prev.low <= check.low && check.high <= prev.high) {
+          redundant[i] = true;
+          break;
+        }
+        if (alwaysReaches(prev.inst, check.inst)) {
+          prev.low = min(prev.low, check.low);
+          prev.high = max(prev.high, check.high);
+          redundant[i] = true;
+          break;
+        }
+      }
+      if (!redundant[i]) {
+        dominating.push_back(i);
+      }
+    }
+
+    vector<BoundsCheck> remaining;
+    for (size_t i = 0; i < checks.size(); ++i) {
+      if (redundant[i]) {
+        NumRedundantChecks++;
+      } else {
+        remaining.push_back(checks[i]);
+      }
+    }
+    DCDBG("removed " << checks.size() - remaining.size() << " redundant checks in " << F.getName() << "\n");
+    checks.swap(remaining);
+  }
   void insertBoundsChecks(Function& F, BoundsMap& boundsMap, const DataLayout& DL, const TargetLibraryInfo& TLI) {
     // we need to check bounds whenever we dereference a pointer ...
     // which is when we:
@@ -3221,7 +4594,16 @@ class BoundsAnalysis {
       }
     }
 
+    set<Value*> loopChecked;
+    if (shouldHoistLoopChecks()) {
+      insertLoopBoundsChecks(F, needsBounds, boundsMap, DL, TLI, loopChecked);
+    }
+
+    vector<BoundsCheck> checks;
     for (auto& inst : needsBounds) {
+      if (loopChecked.count(inst)) {
+        continue;
+      }
       if (auto store = dyn_cast<StoreInst>(inst)) {
         IRBuilder<> IRB(store);
         auto ptrOp = store->getPointerOperand();
@@ -3231,9 +4613,11 @@ class BoundsAnalysis {
         }
         if (isa<GlobalVariable>(ptrOp)) { continue; } // global variables are constant pointers
         auto bounds = getOrLoadBounds(ptrOp, boundsMap, TLI, debugStr, store);
-        if (isStaticallyInBounds(bounds, ptrOp)) { continue; }
-        insertInLineBoundsCheck(F, store, bounds, ptrOp, debugStr, DL);
-        NumBoundsChecks++;
+        if (isStaticallyInBounds(bounds, ptrOp, DL, TLI)) {
+          NumStaticallyInBounds++;
+          continue;
+        }
+        checks.push_back(makeBoundsCheck(store, bounds, ptrOp, debugStr, DL));
       } else if (auto load = dyn_cast<LoadInst>(inst)) {
         NumLoads++;
         IRBuilder<> IRB(load);
@@ -3251,9 +4635,11 @@ class BoundsAnalysis {
         //DCDBG("adding bounds check for load: ");
         //DEBUG(load->dump());
         auto bounds = getOrLoadBounds(ptrOp, boundsMap, TLI, debugStr, load);
-        if (isStaticallyInBounds(bounds, ptrOp)) { continue; }
-        insertInLineBoundsCheck(F, load, bounds, ptrOp, debugStr, DL);
-        NumBoundsChecks++;
+        if (isStaticallyInBounds(bounds, ptrOp, DL, TLI)) {
+          NumStaticallyInBounds++;
+          continue;
+        }
+        checks.push_back(makeBoundsCheck(load, bounds, ptrOp, debugStr, DL));
       } else if (auto call = dyn_cast<CallInst>(inst)) {
 
         if (call->getCalledFunction() || call->isInlineAsm())  {
@@ -3266,14 +4652,41 @@ class BoundsAnalysis {
         auto debugStr = getDebugString(IRB, call);
         auto fnPtr = call->getCalledValue();
         auto bounds = getOrLoadBounds(fnPtr, boundsMap, TLI, debugStr, call);
-        insertInLineBoundsCheck(F, call, bounds, fnPtr, debugStr, DL);
-        NumBoundsChecks++;
+        checks.push_back(makeBoundsCheck(call, bounds, fnPtr, debugStr, DL));
       }
     }
 
+    // the inline checks split blocks, so decide what to check first
+    removeRedundantChecks(F, checks);
+    for (auto& check : checks) {
+      insertInLineBoundsCheck(F, check.inst, check.bounds, check.ptr, check.debugStr, DL,
+                              check.low - check.ptrOffset, check.high - check.ptrOffset);
+      NumBoundsChecks++;
+    }
+
   }
-  bool isStaticallyInBounds(Bounds* bounds, Value* ptr) {
-    // this could probably we better? haha
+  // the bounds of an object always cover the object itself, so an access
+  // at a constant offset into an object of known size needs no check
+  bool isStaticallyInBounds(Bounds* bounds, Value* ptr, const DataLayout& DL, const TargetLibraryInfo& TLI) {
+    if (bounds == infiniteBounds) {
+      return false; // not checked anyway
+    }
+    auto accessSize = getAccessSize(ptr, DL);
+
+    // the allocations we know about: safe heap allocations and sensitive allocas
+    int64_t offset = 0;
+    auto base = GetPointerBaseWithConstantOffset(ptr, offset, DL);
+    if (staticAllocationSizes.count(base)) {
+      auto size = staticAllocationSizes[base];
+      return offset >= 0 && (uint64_t)offset <= size && accessSize <= size - offset;
+    }
+
+    // everything else llvm can size, ie allocas, byval arguments, phis and selects of them.
+    // getObjectSize gives the bytes left after ptr
+    uint64_t remaining = 0;
+    if (getObjectSize(ptr, remaining, DL, &TLI)) {
+      return accessSize <= remaining;
+    }
     return false;
   }
   public:
@@ -3283,10 +4696,170 @@ class BoundsAnalysis {
     auto maxC = ConstantExpr::getIntToPtr(ConstantInt::get(int64Ty, ~0ULL), int8PtrTy);
     infiniteBounds = ConstantStruct::get(boundsTy, boundary, maxC, NULL);
     emptyBounds = ConstantStruct::get(boundsTy, Zero, Zero, NULL);
+    auto unsafeLast = ConstantExpr::getIntToPtr(ConstantInt::get(int64Ty, RTBoundary), int8PtrTy);
+    unsafeRegionBounds = ConstantStruct::get(boundsTy, Zero, unsafeLast, NULL);
+    lowFatMD = MDNode::get(M.getContext(), MDString::get(M.getContext(), lowFatMDString));
     auto DL = M.getDataLayout();
     getRuntimeFunctions();
     createGlobalBounds();
   }
+  bool canPassBoundsInRegisters(Function& F, const TargetLibraryInfo& TLI) {
+    if (F.isDeclaration() || F.isVarArg() || F.mayBeOverridden() || isWhiteListed(F)) {
+      return false;
+    }
+    // called from the runtime or special cased by name elsewhere
+    LibFunc::Func libF;
+    if (F.getName() == "main" || F.getName() == "orig_main"
+        || F.getName() == "strchr" || F.getName() == "strstr"
+        || TLI.getLibFunc(F.getName(), libF)) {
+      return false;
+    }
+    bool hasPointers = F.getReturnType()->isPointerTy();
+    for (auto& arg : F.args()) {
+      hasPointers |= arg.getType()->isPointerTy();
+    }
+    if (!hasPointers) {
+      return false;
+    }
+    // only direct calls, anything else has to use the fn args array
+    for (auto user : F.users()) {
+      auto call = dyn_cast<CallInst>(user);
+      if (!call || call->getCalledValue() != &F || call->isMustTailCall()) {
+        return false;
+      }
+    }
+    return true;
+  }
+  void copyCallSite(CallInst* from, CallInst* to, bool dropReturnAttributes) {
+    auto attrs = from->getAttributes();
+    if (dropReturnAttributes) {
+      attrs = attrs.removeAttributes(M.getContext(), AttributeSet::ReturnIndex, attrs.getRetAttributes());
+    }
+    to->setAttributes(attrs);
+    to->setCallingConv(from->getCallingConv());
+    to->setTailCallKind(from->getTailCallKind());
+    SmallVector<pair<unsigned, MDNode*>, 4> MDs;
+    from->getAllMetadata(MDs);
+    for (auto& md : MDs) {
+      to->setMetadata(md.first, md.second);
+    }
+  }
+  // replaces F with a copy that takes the bounds of every pointer argument
+  // as an extra argument and returns {ptr, bounds} if it returns a pointer.
+  // the new arguments and returns start out as unsafe region bounds, which
+  // is what __ds_get_fn_arg_bounds gives for bounds that were never set
+  void passBoundsInRegisters(Function& F, ValueSet& sensitiveValues) {
+    auto& C = M.getContext();
+    auto FTy = F.getFunctionType();
+    auto retTy = FTy->getReturnType();
+    bool returnsPointer = retTy->isPointerTy();
+
+    vector<Type*> params(FTy->param_begin(), FTy->param_end());
+    vector<int> operands;
+    for (auto paramTy : FTy->params()) {
+      if (paramTy->isPointerTy()) {
+        operands.push_back(params.size());
+        params.push_back(boundsTy);
+      } else {
+        operands.push_back(-1);
+      }
+    }
+    auto newRetTy = returnsPointer ? StructType::get(C, {retTy, boundsTy}) : retTy;
+    auto NFTy = FunctionType::get(newRetTy, params, false);
+
+    auto NF = Function::Create(NFTy, F.getLinkage());
+    NF->copyAttributesFrom(&F);
+    if (returnsPointer) {
+      auto attrs = NF->getAttributes();
+      NF->setAttributes(attrs.removeAttributes(C, AttributeSet::ReturnIndex, attrs.getRetAttributes()));
+    }
+    SmallVector<pair<unsigned, MDNode*>, 4> MDs;
+    F.getAllMetadata(MDs);
+    for (auto& md : MDs) {
+      NF->setMetadata(md.first, md.second);
+    }
+    M.getFunctionList().insert(F.getIterator(), NF);
+    NF->takeName(&F);
+    NF->getBasicBlockList().splice(NF->begin(), F.getBasicBlockList());
+
+    auto newArg = NF->arg_begin();
+    for (auto& arg : F.args()) {
+      newArg->takeName(&arg);
+      arg.replaceAllUsesWith(&*newArg);
+      sensitiveValues.replace(&arg, &*newArg);
+      ++newArg;
+    }
+    for (auto& arg : F.args()) {
+      auto opNo = operands[arg.getArgNo()];
+      if (opNo >= 0) {
+        auto newArgIt = NF->arg_begin();
+        advance(newArgIt, arg.getArgNo());
+        auto boundsArg = NF->arg_begin();
+        advance(boundsArg, opNo);
+        boundsArg->setName(newArgIt->getName() + "_bounds");
+        boundsArguments[&*newArgIt] = &*boundsArg;
+      }
+    }
+
+    if (returnsPointer) {
+      vector<ReturnInst*> returns;
+      for (auto& BB : *NF) {
+        if (auto ret = dyn_cast<ReturnInst>(BB.getTerminator())) {
+          returns.push_back(ret);
+        }
+      }
+      for (auto ret : returns) {
+        IRBuilder<> IRB(ret);
+        auto rv = ret->getReturnValue();
+        auto withPtr = IRB.CreateInsertValue(UndefValue::get(newRetTy), rv, 0);
+        auto withBounds = cast<InsertValueInst>(IRB.CreateInsertValue(withPtr, unsafeRegionBounds, 1));
+        auto newRet = IRB.CreateRet(withBounds);
+        boundsReturns[newRet] = make_pair(rv, withBounds);
+        ret->eraseFromParent();
+      }
+    }
+
+    vector<CallInst*> calls;
+    for (auto user : F.users()) {
+      calls.push_back(cast<CallInst>(user));
+    }
+    for (auto call : calls) {
+      vector<Value*> args(call->arg_begin(), call->arg_end());
+      for (auto opNo : operands) {
+        if (opNo >= 0) {
+          args.push_back(unsafeRegionBounds);
+        }
+      }
+      auto newCall = CallInst::Create(NF, args, "", call);
+      copyCallSite(call, newCall, returnsPointer);
+      Value* result = newCall;
+      if (returnsPointer) {
+        result = ExtractValueInst::Create(newCall, 0, "", call);
+      }
+      result->takeName(call);
+      call->replaceAllUsesWith(result);
+      sensitiveValues.replace(call, result);
+      call->eraseFromParent();
+    }
+    sensitiveValues.replace(&F, NF);
+    F.eraseFromParent();
+    boundsOperands[NF] = operands;
+  }
+  void passBoundsInRegisters(ValueSet& sensitiveValues, const TargetLibraryInfo& TLI) {
+    if (!RegisterBounds || DebugMode) {
+      return;
+    }
+    vector<Function*> candidates;
+    for (auto& F : M) {
+      if (canPassBoundsInRegisters(F, TLI)) {
+        candidates.push_back(&F);
+      }
+    }
+    for (auto F : candidates) {
+      passBoundsInRegisters(*F, sensitiveValues);
+    }
+    NumRegisterBoundsFunctions += candidates.size();
+  }
   void runOnFunction(Function& F, const DataLayout& DL, const TargetLibraryInfo& TLI) {
       InstructionSet sensAllocs;
       BoundsMap boundsMap;
@@ -3296,6 +4869,9 @@ class BoundsAnalysis {
       if (!F.getName().startswith("ngx_vslprintf")) {
         insertBoundsChecks(F, boundsMap, DL, TLI);
       }
+      if (shouldUseLowFatBounds()) {
+        guardTableLookups(F);
+      }
   }
 
 }; // end class BoundsAnalysis
@@ -3322,6 +4898,7 @@ struct DataShield : public ModulePass {
         dbgs() << "[DATASHIELD] Finished saving module.\n";
     }
 
+    resetModuleState();
     whiteList.push_back("llvm.dbg");
     whiteList.push_back("llvm.lifetime");
     whiteList.push_back("__ds");
@@ -3335,6 +4912,8 @@ struct DataShield : public ModulePass {
 
     // conservatively replace every free/malloc/calloc/realloc/strdup with the unsafe verision
 
+    PhaseReport report;
+    report.start("replace memman functions");
     dbgs() << "[DATASHIELD] Replacing all memman functions with unsafe ...\n";
     if (LibraryMode) {
       replaceAllByNameWith(M, "malloc", *unsafeMalloc);
@@ -3375,6 +4954,7 @@ struct DataShield : public ModulePass {
     Sandboxer boxer(M);
 
     dbgs() << "[DATASHIELD] Starting sensitivity analysis.\n";
+    report.start("sensitivity analysis");
     SensitivityAnalysis SA(M);
     if (SA.sensitiveTypes.size() != 0) {
       SA.analyzeModule();
@@ -3411,7 +4991,14 @@ struct DataShield : public ModulePass {
 
     //SA.sensitiveSet.dump();
     dbgs() << "[DATASHIELD] Finished sensitivity analysis.\n";
+    if (TimeReport) {
+      dbgs() << "[DATASHIELD] " << SA.sensitiveSet.size() << " sensitive values, "
+             << SA.sensitiveTypes.size() << " sensitive types, "
+             << SA.newFunctions.size() << " cloned functions with "
+             << SA.clonedInstructions << " instructions\n";
+    }
 
+    report.start("pointer masks");
     for (auto& F : M) {
       if (!isWhiteListed(F)) {
         boxer.insertPointerMasks(F, SA.sensitiveSet);
@@ -3419,6 +5006,7 @@ struct DataShield : public ModulePass {
     }
 
     dbgs() << "start memory regioner\n";
+    report.start("memory regioner");
     MemoryRegioner regioner(M, SA.sensitiveSet);
 
     for (auto& F : M) {
@@ -3433,7 +5021,9 @@ struct DataShield : public ModulePass {
     dbgs() << "end memory regioner\n";
 
     dbgs() << "start bounds analysis\n";
+    report.start("bounds analysis");
     BoundsAnalysis BA(M, TLI, SA.sensitiveSet);
+    BA.passBoundsInRegisters(SA.sensitiveSet, TLI);
     for (auto& F : M) {
       if (!isWhiteListed(F)) {
         BA.runOnFunction(F, DL, TLI);
@@ -3441,28 +5031,18 @@ struct DataShield : public ModulePass {
     }
     dbgs() << "end bounds analysis\n";
 
+    report.start("metadata copies");
     for (auto& F : M) {
       for (inst_iterator It = inst_begin(F), Ie = inst_end(F); It != Ie;) {
         Instruction *I = &*(It++);
         if (auto call = dyn_cast<CallInst>(I)) {
           if (auto calledF = call->getCalledFunction()) {
             if (calledF->hasName() && calledF->getName().startswith("llvm.memcpy")) {
-              auto dest = call->getArgOperand(0);
-              auto src = call->getArgOperand(1);
-              auto sz = call->getArgOperand(2);
-              if (SA.sensitiveSet.count(dest)) {
+              if (SA.sensitiveSet.count(call->getArgOperand(0))) {
                 //if (isa<Constant>(src)) {
                 //  continue; // right now globals don't have bounds.  and globals are probably strings anyway
                 //}
-                if (DebugMode) {
-                  auto id = ConstantInt::get(int64Ty, IDCounter++);
-                  IRBuilder<> IRB(call->getNextNode());
-                  IRB.CreateCall(metadataCopyDebug, {dest, src, sz, id});
-                } else {
-                  // insert a call to bound the bounds of the interior members
-                  IRBuilder<> IRB(call->getNextNode());
-                  IRB.CreateCall(metadataCopy, {dest, src, sz});
-                }
+                insertMetadataCopy(call, DL);
               }
             }
           }
@@ -3470,6 +5050,7 @@ struct DataShield : public ModulePass {
       }
     }
     dbgs() << "end llvm.memcpy metadata copying\n";
+    report.start("annotations and cleanup");
 
     boxer.copyAndReplaceArgvIfNecessary(M, SA.sensitiveSet);
 
@@ -3635,7 +5216,10 @@ struct DataShield : public ModulePass {
         insertStatsDump(M);
     }
 
+    boxer.preventInliningIntoUnmaskedFunctions(M);
+
     DEBUG(dbgs() << "pass finished\n");
+    report.print(dbgs());
 
     if (SaveModuleAfter) {
       dbgs() << "saving module\n";
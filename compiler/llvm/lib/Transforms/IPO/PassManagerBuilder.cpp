@@ -44,6 +44,11 @@ DoDataShieldLTO("datashield-lto");
 static cl::opt<bool>
 DoDataShieldModular("datashield-modular");
 
+static cl::opt<unsigned>
+DataShieldPostOptLevel("datashield-post-opt-level", cl::init(0),
+    cl::desc("Cleanup pipeline run after DataShield instrumentation "
+             "(0 = none, 1 = peephole, 2 = scalar, 3 = scalar + inlining)"));
+
 static cl::opt<bool>
 RunLoopVectorization("vectorize-loops", cl::Hidden,
                      cl::desc("Run the Loop vectorization passes"));
@@ -247,7 +252,7 @@ void PassManagerBuilder::populateModulePassManager(
       MPM.add(createBarrierNoopPass());
 
     if(DoDataShieldModular) {
-        MPM.add(createDataShieldPass());
+        addDataShieldPasses(MPM);
     }
 
     addExtensionsToPM(EP_EnabledOnOptLevel0, MPM);
@@ -537,7 +542,7 @@ void PassManagerBuilder::populateModulePassManager(
     MPM.add(createMergeFunctionsPass());
 
   if(DoDataShieldModular) {
-      MPM.add(createDataShieldPass());
+      addDataShieldPasses(MPM);
   }
 
   addExtensionsToPM(EP_OptimizerLast, MPM);
@@ -682,6 +687,44 @@ void PassManagerBuilder::addLateLTOOptimizationPasses(
     PM.add(createMergeFunctionsPass());
 }
 
+void PassManagerBuilder::addDataShieldPasses(legacy::PassManagerBase &PM) {
+  PM.add(createDataShieldPass());
+
+  // Everything DataShield inserts (masks, bounds lookups, split check blocks)
+  // would otherwise go straight to codegen.  Only passes that preserve the
+  // semantics of the masks are used here: no loop idiom recognition or
+  // vectorization (they re-derive addresses from the unmasked induction
+  // variable) and no IPO passes that rewrite function signatures.
+  if (DataShieldPostOptLevel == 0)
+    return;
+
+  addInitialAliasAnalysisPasses(PM);
+
+  if (DataShieldPostOptLevel >= 3) {
+    // The pass marks call sites in unmasked functions noinline when masks are
+    // applied at code emission, so inlining cannot drop a mask.
+    PM.add(createFunctionInliningPass(DataShieldPostOptLevel, SizeLevel));
+    PM.add(createPruneEHPass());
+  }
+
+  PM.add(createEarlyCSEPass());
+  PM.add(createInstructionCombiningPass());
+  PM.add(createCFGSimplificationPass());
+
+  if (DataShieldPostOptLevel >= 2) {
+    PM.add(createJumpThreadingPass());
+    PM.add(createCorrelatedValuePropagationPass());
+    PM.add(createLICMPass());                 // Hoist bounds lookups.
+    PM.add(createGVNPass(DisableGVNLoadPRE)); // Merge redundant masks.
+    PM.add(createDeadStoreEliminationPass());
+    PM.add(createInstructionCombiningPass());
+    PM.add(createCFGSimplificationPass());
+  }
+
+  if (DataShieldPostOptLevel >= 3)
+    PM.add(createGlobalDCEPass());
+}
+
 void PassManagerBuilder::populateLTOPassManager(legacy::PassManagerBase &PM) {
   if (LibraryInfo)
     PM.add(new TargetLibraryInfoWrapperPass(*LibraryInfo));
@@ -705,10 +748,8 @@ void PassManagerBuilder::populateLTOPassManager(legacy::PassManagerBase &PM) {
     addLateLTOOptimizationPasses(PM);
 
   if (DoDataShieldLTO) {
-    PM.add(createDataShieldPass());
+    addDataShieldPasses(PM);
     //PM.add(createVerifierPass());
-    //if (OptLevel != 0)
-    //  addLateLTOOptimizationPasses(PM);
   }
 
   if (VerifyOutput)
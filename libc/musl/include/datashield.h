@@ -1,2 +1,10 @@
-int  __ds_unsafe_clone(void (*fn)(void*), void* arg);
+int  __ds_call_on_stack(int (*fn)(void*), void* arg, void* stack_top);
+extern void* __ds_unsafe_stack_top;
 void __ds_init(void);
+void __ds_thread_init(void);
+void __ds_thread_exit(void);
+struct pthread;
+void __ds_release_thread_stack(struct pthread*);
+void* __ds_unsafe_mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset);
+int   __ds_unsafe_munmap(void* addr, size_t length);
+void  __ds_va_release(void* addr, size_t length);
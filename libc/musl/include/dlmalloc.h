@@ -605,6 +605,22 @@ void** mspace_independent_comalloc(mspace msp, size_t n_elements,
                                    size_t sizes[], void* chunks[]);
 size_t mspace_bulk_free(mspace msp, void**, size_t n_elements);
 size_t mspace_usable_size(const void* mem);
+
+/*
+  mspace_dirty_size returns how many leading bytes of mem may be non-zero.
+  It is only meaningful right after mem was allocated: memory that was
+  never handed out before (fresh pages of the mspace, mmapped chunks) is
+  known to be zero and reports 0.
+*/
+size_t mspace_dirty_size(const void* mem);
+
+/*
+  mspace_set_reserve lets a space made with create_mspace_with_base grow
+  into the size bytes right after its base, which the caller mapped
+  PROT_NONE.  They are made writable as needed, and the space doesn't mmap
+  anything else from then on.  Returns 1 on success.
+*/
+int mspace_set_reserve(mspace msp, size_t size);
 void mspace_malloc_stats(mspace msp);
 int mspace_trim(mspace msp, size_t pad);
 size_t mspace_footprint(mspace msp);
@@ -3,5 +3,7 @@
 #define MSPACES 1
 #define ONLY_MSPACES 1
 #endif
+// the safe and unsafe regions are shared between threads
+#define USE_LOCKS 1
 //#define USE_DL_PREFIX 1
 #endif
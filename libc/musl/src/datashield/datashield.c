@@ -6,25 +6,30 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include <ctype.h>
 #include <netdb.h>
 #include <locale.h>
 #include "dlmalloc.h"
+#include "thread_cache.h"
+#include "lowfat.h"
+#include "vaspace.h"
 
 //#define DEBUG_MODE
 //
 //
 
 typedef struct {void *base, *last;} __ds_bounds_t;
-typedef struct {
-  //void *ptrAddr;
-  __ds_bounds_t bounds;
-} __ds_table_entry;
+// compact bounds: the low half is the base's offset from SAFE_ORIGIN and
+// the high half the object's size, see __ds_encode_bounds
+typedef uint64_t __ds_table_entry;
 
 
 #ifdef DEBUG_MODE
@@ -39,27 +44,68 @@ typedef struct {
 #define __CTYPE_B_LOC_SIZE (384)
 #define BOUNDARY ((1ull << 32) - 1)
 #define PAD (4096)
+// defaults for the sizes __ds_init reads from the environment.  the heaps
+// only reserve their address space up front and make HEAP_COMMIT of it
+// usable, the mspaces grow into the rest as needed
 #define UNSAFE_STACK_SIZE (1024*8192)
-#define UNSAFE_STACK_HINT (BOUNDARY - PAD - UNSAFE_STACK_SIZE)
-
 #define UNSAFE_HEAP_SIZE (1ull << 31)
+#define SAFE_HEAP_SIZE (1ull << 32)
+#define SAFE_STACK_SIZE (1024*8192)
+// inaccessible bytes below every safe stack.  the pass keeps each frame on
+// the safe stack smaller than this, so an overflow faults instead of
+// running into the safe heap objects below (RTSafeStackGuard in the pass)
+#define SAFE_STACK_GUARD (1ull << 16)
+#define HEAP_COMMIT (1ull << 26)
+// the unsafe mappings share the low 4GB with the program image and its brk
+// heap, leave the latter some room to grow before they start
+#define BRK_RESERVE (1ull << 26)
+
+// the linker script puts the sensitive globals at SAFE_ORIGIN and the safe
+// heap starts on the page after them (_end), so everything with bounds is
+// within 4GB of SAFE_ORIGIN
+#define SAFE_ORIGIN (BOUNDARY + 1)
+#define SAFE_HEAP_END (SAFE_ORIGIN + (1ull << 32ull))
+// the low-fat classes take the top of the safe heap and dlmalloc the rest,
+// which shouldn't be squeezed below this by the globals
+#define SAFE_MSPACE_MIN (1ull << 28)
+#define PAGE (4096ull)
 
-#define SAFE_HEAP_SIZE (1ull << 32ull)
-#define METADATA_TABLE_SIZE (2ull*SAFE_HEAP_SIZE)
-#define SAFE_REGION_SIZE (SAFE_HEAP_SIZE + METADATA_TABLE_SIZE)
-#define SAFE_HEAP_HINT (BOUNDARY + PAD)
+// one entry for every 8 bytes from SAFE_ORIGIN on, mapped right after the
+// safe heap.  only the pages that get written are ever backed
+#define METADATA_TABLE_HINT (SAFE_ORIGIN + (1ull << 32ull))
+// the globals, the main thread's safe stack and the first long lived
+// objects sit at the bottom, DATASHIELD_SHADOW_THP=1 backs their entries
+// with huge pages
+#define SHADOW_HOT_SIZE (1ull << 26)
+// freeing a safe object at least this big gives its entries' pages back
+#define SHADOW_RECLAIM_MIN (1ull << 18)
 
+// the pass hardcodes this one, see RTNumArgEntries in DataShield.cpp
 #define N_ARG_ENTRIES (128)
-#define N_TABLE_ENTRIES (METADATA_TABLE_SIZE / sizeof(__ds_table_entry))
-//#define GLOBAL_RESERVE (32768ull) // hopefully we dont have more than 8*32768 bytes of globals
-#define GLOBAL_RESERVE (32768ull*100) // hopefully we dont have more than 8*32768 bytes of globals
-//#define N_TABLE_ENTRIES (1ull << 27)
+
+// end of the sensitive globals
+extern char _end[];
+
+// the pass puts one of these in the __ds_global_bounds section for every
+// pointer in the initializers of sensitive globals, and __ds_init copies
+// them into the table before any constructor runs
+typedef struct {
+  void* ptr;
+  __ds_bounds_t bounds;
+} __ds_global_bounds_t;
+
+extern __ds_global_bounds_t __start___ds_global_bounds[] __attribute__((weak, visibility("hidden")));
+extern __ds_global_bounds_t __stop___ds_global_bounds[] __attribute__((weak, visibility("hidden")));
 
 
 //void* unsafe_stack_bottom;
 void* unsafe_heap;
 void* safe_heap;
 mspace unsafe_region, safe_region;
+static size_t unsafe_heap_size, safe_stack_size;
+static size_t n_table_entries;
+// top of the stack main runs on
+void* __ds_unsafe_stack_top;
 //size_t __ds_table_count = 0;
 size_t __ds_num_masks = 0;
 __attribute__((visibility("default")))
@@ -67,9 +113,28 @@ size_t __ds_num_bounds_checks = 0;
 size_t __ds_num_safe_heap_allocs = 0;
 size_t __ds_num_unsafe_heap_allocs = 0;
 
+// unsafe mallocs hand out zeroed memory, but only clear what the allocator
+// doesn't know to be zero.  DATASHIELD_ZERO_UNSAFE=0 makes them plain mallocs
+static int zero_unsafe_allocs = 1;
+
+// small safe objects come from the low-fat classes when DATASHIELD_LOWFAT=1,
+// so code built with -datashield-lowfat-bounds can compute their bounds
+// from the pointer
+static int lowfat_safe_allocs = 0;
 
+
+// the pass emits the lookups into the table (at METADATA_TABLE_HINT) and
+// __ds_fn_args inline (see -datashield-inline-runtime), so the layout
+// above must match the constants in DataShield.cpp
+__attribute__((visibility("default")))
 __ds_table_entry *__ds_table = 0;
 
+// top of this thread's safe stack (see -datashield-safe-stack).  functions
+// with sensitive locals move it down on entry and restore it on return
+__attribute__((visibility("default")))
+__thread void* __ds_safe_stack_ptr __attribute__((tls_model("initial-exec"))) = 0;
+static __thread void* __ds_safe_stack_bottom __attribute__((tls_model("initial-exec"))) = 0;
+
 #define __ds_invalid_bounds ((__ds_bounds_t) { (void*)~0x0ull, (void*)(0x0ull)} )
 
 #define __ds_empty_bounds ((__ds_bounds_t) { (void*)0x0ull, (void*)(0x0ull)} )
@@ -78,7 +143,45 @@ __ds_table_entry *__ds_table = 0;
 
 #define __ds_unsafe_region_bounds ((__ds_bounds_t) { (void*)0x0ull, (void*)BOUNDARY} )
 
-__ds_bounds_t __ds_fn_args_array[N_ARG_ENTRIES]; // TODO allocate this in the safe region
+// a size of ~0 marks bounds that aren't about a safe object: offset 0 is
+// the unsafe region and offset 1 everything above it.  the pass emits the
+// same encoding and decoding inline, keep them in sync
+#define ESCAPE_SIZE (0xffffffffull)
+
+static inline __ds_table_entry __ds_encode_bounds(__ds_bounds_t bounds) {
+  uint64_t base = (uint64_t)bounds.base, last = (uint64_t)bounds.last;
+  if (last == ~0ull) {
+    return (ESCAPE_SIZE << 32) | 1;
+  } else if ((base >> 32) == 1) {
+    return ((last - base + 1) << 32) | (base & 0xffffffffull);
+  } else if (base >> 32) {
+    return (ESCAPE_SIZE << 32) | 1;
+  } else {
+    // empty bounds (null) encode as 0, so the zeroed table starts out
+    // empty.  other bounds below the boundary widen to the unsafe region
+    return last ? ESCAPE_SIZE << 32 : 0;
+  }
+}
+
+static inline __ds_bounds_t __ds_decode_bounds(__ds_table_entry entry) {
+  uint64_t offset = entry & 0xffffffffull, size = entry >> 32;
+  __ds_bounds_t bounds;
+  if (size == ESCAPE_SIZE) {
+    bounds.base = (void*)(offset << 32);
+    bounds.last = (void*)((-offset << 32) | 0xffffffffull);
+  } else {
+    // an empty entry gives last < base, which fails every check
+    bounds.base = (void*)(SAFE_ORIGIN + offset);
+    bounds.last = (void*)(SAFE_ORIGIN + offset + size - 1);
+  }
+  return bounds;
+}
+
+// bounds of pointer arguments passed between instrumented functions.
+// every thread gets its own array, allocated in the safe region by
+// __ds_thread_init so masked stores can't reach it
+__attribute__((visibility("default")))
+__thread __ds_bounds_t* __ds_fn_args __attribute__((tls_model("initial-exec"))) = 0;
 
 //__attribute__((visibility("default")))
 //char** __ds_environ;
@@ -93,30 +196,63 @@ void __ds_debug_bounds_sanity_check(__ds_bounds_t bounds) {
   }
 }
 
+// globals, the safe heap and the safe stacks are all indexed the same
+// way, so &__ds_table[hash] is just (ptr & ~7) + a constant
 size_t __ds_hash(void* ptr) {
   DEBUG("ptr: %p\n", ptr);
-  DEBUG_ASSERT((size_t)ptr >= BOUNDARY);
-  size_t hash = 0;
-  if (ptr < __ds_table) {
-      hash = ((size_t) ptr - BOUNDARY) / 8;
-      DEBUG("hash: %li\n", hash);
-      DEBUG_ASSERT(hash < GLOBAL_RESERVE);
-  } else {
-      hash = ((size_t) ptr  - ((size_t) __ds_table + sizeof(__ds_table_entry)*N_TABLE_ENTRIES)) / 8ull + GLOBAL_RESERVE;
-      //size_t hash = ((size_t) __ds_table - (size_t)ptr ) / 8 ;
-  }
+  DEBUG_ASSERT((size_t)ptr >= SAFE_ORIGIN);
+  size_t hash = ((size_t)ptr - SAFE_ORIGIN) >> 3;
   DEBUG("hash: %lu\n", hash);
-  DEBUG_ASSERT(hash < N_TABLE_ENTRIES);
+  DEBUG_ASSERT(hash < n_table_entries);
   return hash;
 }
 
+// drop the table pages that only describe [ptr, ptr+n).  has to happen
+// before the object is freed, once another thread gets the memory it
+// may already have stored bounds there
+static void __ds_reclaim_shadow(void* ptr, size_t n) {
+  if (n < SHADOW_RECLAIM_MIN) { return; }
+  uintptr_t start = (uintptr_t)&__ds_table[__ds_hash(ptr)];
+  // one past the object can be one past the table
+  uintptr_t end = (uintptr_t)(__ds_table + (((size_t)ptr + n - SAFE_ORIGIN) >> 3));
+  start = (start + PAGE - 1) & ~(PAGE - 1);
+  end &= ~(PAGE - 1);
+  if (start < end) {
+    madvise((void*)start, end - start, MADV_DONTNEED);
+  }
+}
+
+static inline void* __ds_safe_heap_alloc(size_t n) {
+  void* ptr = lowfat_safe_allocs ? __ds_lowfat_malloc(n) : 0;
+  return ptr ? ptr : __ds_tc_malloc(DS_SAFE_REGION, n);
+}
+
+static inline void* __ds_safe_heap_calloc(size_t n, size_t elem_size) {
+  size_t total = n * elem_size;
+  if (!lowfat_safe_allocs || (elem_size && total / elem_size != n)) {
+    return __ds_tc_calloc(DS_SAFE_REGION, n, elem_size);
+  }
+  void* ptr = __ds_lowfat_calloc(total);
+  return ptr ? ptr : __ds_tc_calloc(DS_SAFE_REGION, n, elem_size);
+}
+
+static inline void __ds_safe_release(void* ptr) {
+  if (__ds_is_lowfat(ptr)) {
+    __ds_reclaim_shadow(ptr, __ds_lowfat_size(ptr));
+    __ds_lowfat_free(ptr);
+    return;
+  }
+  __ds_reclaim_shadow(ptr, __ds_tc_usable_size(DS_SAFE_REGION, ptr));
+  __ds_tc_free(DS_SAFE_REGION, ptr);
+}
+
 __attribute__((visibility("default")))
 void __ds_set_fn_arg_bounds_debug(size_t i, __ds_bounds_t bounds, const char* msg) {
   DEBUG("(set fn arg) @ %lu <= [%p, %p] from: %s\n", i, bounds.base, bounds.last, msg);
 #ifdef DEBUG_MODE
   __ds_debug_bounds_sanity_check(bounds);
 #endif
-  __ds_fn_args_array[i] = bounds;
+  __ds_fn_args[i] = bounds;
 }
 
 // mallocs
@@ -125,8 +261,8 @@ void* __ds_unsafe_malloc(size_t n) {
 #ifdef DEBUG_MODE
   ++__ds_num_unsafe_heap_allocs;
 #endif
-  void* ptr = mspace_malloc(unsafe_region, n);
-  memset(ptr, 0, n);
+  void* ptr = zero_unsafe_allocs ? __ds_tc_calloc(DS_UNSAFE_REGION, 1, n)
+                                : __ds_tc_malloc(DS_UNSAFE_REGION, n);
   DEBUG("unsafe malloc: %li@%p\n", n, ptr);
   return ptr;
 }
@@ -135,21 +271,21 @@ void* __ds_safe_malloc(size_t n) {
 #ifdef DEBUG_MODE
   ++__ds_num_safe_heap_allocs;
 #endif
-  void* ptr = mspace_malloc(safe_region, n);
+  void* ptr = __ds_safe_heap_alloc(n);
   DEBUG("safe malloc: %li@%p\n", n, ptr);
   return ptr;
 }
  __attribute__((visibility("default")))
 void* __ds_debug_safe_malloc(size_t n, char* msg, size_t id) {
   ++__ds_num_safe_heap_allocs;
-  void* ptr = mspace_malloc(safe_region, n);
+  void* ptr = __ds_safe_heap_alloc(n);
   DEBUG("safe malloc: %li@%p. from: %s. ID: %li\n", n, ptr, msg, id);
   return ptr;
 }
 
 __attribute__((visibility("default")))
 void* __ds_debug_safe_alloc(size_t n, size_t id) {
-  void* ptr = mspace_malloc(safe_region, n);
+  void* ptr = __ds_safe_heap_alloc(n);
   DEBUG("safe alloc: %li@%p. ID: %li\n", n, ptr, id);
   return ptr;
 }
@@ -161,7 +297,7 @@ void __ds_unsafe_free(void* ptr) {
   //ptr = (void*) ((size_t)(ptr) & ((1ull << 32) - 1));
   DEBUG("unsafe free: %p\n", ptr);
   DEBUG_ASSERT((size_t)ptr < BOUNDARY);
-  mspace_free(unsafe_region, ptr);
+  __ds_tc_free(DS_UNSAFE_REGION, ptr);
 }
 // frees
 __attribute__((visibility("default")))
@@ -169,7 +305,7 @@ void __ds_safe_free(void* ptr) {
   DEBUG("safe free: %p\n", ptr);
   if (ptr == 0) { return; }
   DEBUG_ASSERT((size_t)ptr > BOUNDARY);
-  mspace_free(safe_region, ptr);
+  __ds_safe_release(ptr);
 }
 
 __attribute__((visibility("default")))
@@ -177,7 +313,7 @@ void __ds_safe_free_debug(void* ptr, size_t id) {
   DEBUG("safe free: %p.  ID:%li \n", ptr, id);
   if (ptr == 0) { return; } // it's valid to call free on a nullptr (nothing happens)
   DEBUG_ASSERT(ptr && (size_t)ptr > BOUNDARY);
-  mspace_free(safe_region, ptr);
+  __ds_safe_release(ptr);
 }
 
  __attribute__((visibility("default")))
@@ -185,7 +321,7 @@ void __ds_safe_dealloc(void* ptr, size_t id) {
   DEBUG("safe dealloc: %p. ID: %li\n", ptr, id);
   if (ptr == 0) { return; } // it's valid to call free on a nullptr (nothing happens)
   DEBUG_ASSERT((size_t)ptr > BOUNDARY);
-  mspace_free(safe_region, ptr);
+  __ds_safe_release(ptr);
 }
 
 // callocs
@@ -194,7 +330,7 @@ void* __ds_unsafe_calloc(size_t n, size_t elem_size) {
 #ifdef DEBUG_MODE
   ++__ds_num_unsafe_heap_allocs;
 #endif
-  void* ptr = mspace_calloc(unsafe_region, n, elem_size);
+  void* ptr = __ds_tc_calloc(DS_UNSAFE_REGION, n, elem_size);
   DEBUG("unsafe calloc: %lix%li@%p\n", n, elem_size, ptr);
   return ptr;
 }
@@ -203,14 +339,14 @@ void* __ds_safe_calloc(size_t n, size_t elem_size) {
 #ifdef DEBUG_MODE
   ++__ds_num_safe_heap_allocs;
 #endif
-  void* ptr = mspace_calloc(safe_region, n, elem_size);
+  void* ptr = __ds_safe_heap_calloc(n, elem_size);
   DEBUG("safe calloc: %lix%li@%p\n", n, elem_size, ptr);
   return ptr;
 }
 __attribute__((visibility("default")))
 void* __ds_debug_safe_calloc(size_t n, size_t elem_size, char* msg) {
   ++__ds_num_safe_heap_allocs;
-  void* ptr = mspace_calloc(safe_region, n, elem_size);
+  void* ptr = __ds_safe_heap_calloc(n, elem_size);
   DEBUG("safe calloc: %lix%li@%p. from: %s\n", n, elem_size, ptr, msg);
   return ptr;
 }
@@ -222,7 +358,7 @@ void* __ds_unsafe_realloc(void* ptr, size_t n) {
   ++__ds_num_unsafe_heap_allocs;
 #endif
   DEBUG("unsafe realloc requested\n");
-  void* new_ptr = mspace_realloc(unsafe_region, ptr, n);
+  void* new_ptr = __ds_tc_realloc(DS_UNSAFE_REGION, ptr, n);
   DEBUG("unsafe realloc: %p:%li => %p\n", ptr, n, new_ptr);
   return new_ptr;
 }
@@ -232,7 +368,19 @@ void* __ds_safe_realloc(void* ptr, size_t n) {
   ++__ds_num_safe_heap_allocs;
 #endif
   DEBUG("safe realloc requested: @%p x %li\n", ptr, n);
-  void* new_ptr = mspace_realloc(safe_region, ptr, n);
+  void* new_ptr;
+  if (__ds_is_lowfat(ptr)) {
+    // keep the byte past the end free, see size_class in lowfat.c
+    size_t size = __ds_lowfat_size(ptr);
+    if (n < size) { return ptr; }
+    new_ptr = __ds_safe_heap_alloc(n);
+    if (new_ptr) {
+      memcpy(new_ptr, ptr, size);
+      __ds_safe_release(ptr);
+    }
+  } else {
+    new_ptr = __ds_tc_realloc(DS_SAFE_REGION, ptr, n);
+  }
   DEBUG("safe realloc: %p:%li => %p\n", ptr, n, new_ptr);
   return new_ptr;
 }
@@ -355,13 +503,32 @@ void* __ds_unsafe_mmap(void* addr, size_t length, int prot, int flags,
   DEBUG("flags: %i\n", flags);
   DEBUG("fd: %i\n", flags);
   DEBUG("offset: %li\n", offset);
-  void* rv =  mmap(addr, length, prot, flags | MAP_32BIT, fd, offset);
+  void* rv = __ds_va_mmap(addr, length, prot, flags, fd, offset);
   if (rv == MAP_FAILED) {
     DEBUG("ERROR: %d - %s\n", errno, strerror(errno));
   }
   return rv;
 }
 
+__attribute__((visibility("default")))
+int __ds_unsafe_munmap(void* addr, size_t length) {
+  DEBUG("munmap addr: %p length: %li\n", addr, length);
+  return __ds_va_munmap(addr, length);
+}
+
+__attribute__((visibility("default")))
+void* __ds_unsafe_mremap(void* old_addr, size_t old_len, size_t new_len, int flags, ...) {
+  DEBUG("mremap addr: %p length: %li => %li\n", old_addr, old_len, new_len);
+  void* new_addr = 0;
+  if (flags & MREMAP_FIXED) {
+    va_list ap;
+    va_start(ap, flags);
+    new_addr = va_arg(ap, void*);
+    va_end(ap);
+  }
+  return __ds_va_mremap(old_addr, old_len, new_len, flags, new_addr);
+}
+
 //__attribute__((visibility("default")))
 //const unsigned short ** __ds_unsafe_ctype_b_loc(void) {
 //  const static unsigned short **obj = 0;
@@ -406,7 +573,7 @@ __attribute__((visibility("default")))
 __ds_bounds_t __ds_get_bounds_debug(void* ptrAddr, char* msg, size_t id) {
   DEBUG("(get bounds: %li) @ %p => ", id, ptrAddr);
   size_t hash = __ds_hash(ptrAddr);
-  __ds_bounds_t bounds = __ds_table[hash].bounds;
+  __ds_bounds_t bounds = __ds_decode_bounds(__ds_table[hash]);
   DEBUG("[%p,%p)  from : %s.\n", bounds.base, bounds.last,  msg, id);
 #ifdef DEBUG_MODE
   __ds_debug_bounds_sanity_check(bounds);
@@ -417,7 +584,7 @@ __ds_bounds_t __ds_get_bounds_debug(void* ptrAddr, char* msg, size_t id) {
 
 __attribute__((visibility("default")))
 __ds_bounds_t __ds_get_fn_arg_bounds_debug(size_t i, char* msg, size_t id) {
-  __ds_bounds_t bounds = __ds_fn_args_array[i];
+  __ds_bounds_t bounds = __ds_fn_args[i];
   DEBUG("(get fn args ID:%li) @ %li => [%p, %p). from: %s\n", id, i, bounds.base, bounds.last, msg);
 #ifdef DEBUG_MODE
   if (bounds.base == __ds_invalid_bounds.base && bounds.last == __ds_invalid_bounds.last) {
@@ -425,7 +592,7 @@ __ds_bounds_t __ds_get_fn_arg_bounds_debug(size_t i, char* msg, size_t id) {
     assert(0);
   }
 #endif
-  __ds_fn_args_array[i] = __ds_invalid_bounds;
+  __ds_fn_args[i] = __ds_invalid_bounds;
   return bounds;
 }
 
@@ -437,7 +604,44 @@ void __ds_set_bounds_debug(void *ptrAddr, __ds_bounds_t bounds, const char* msg,
   __ds_debug_bounds_sanity_check(bounds);
 #endif
   size_t hash = __ds_hash(ptrAddr);
-  __ds_table[hash].bounds = bounds;
+  __ds_table[hash] = __ds_encode_bounds(bounds);
+}
+
+void __ds_thread_init();
+
+// a size in bytes with an optional k, m or g suffix, rounded up to pages
+static size_t env_size(const char* name, size_t def) {
+  char* s = getenv(name);
+  if (!s || !*s) { return def; }
+  char* end;
+  errno = 0;
+  unsigned long long n = strtoull(s, &end, 0);
+  int shift = 0;
+  switch (*end) {
+    case 'g': case 'G': shift = 30; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'k': case 'K': shift = 10; end++; break;
+  }
+  if (!isdigit((unsigned char)*s) || errno || *end || !n || n > SIZE_MAX >> shift
+      || (n << shift) > SIZE_MAX - (PAGE - 1)) {
+    fprintf(stderr, "bad size in %s: %s\n", name, s);
+    assert(0);
+  }
+  return ((n << shift) + PAGE - 1) & ~(PAGE - 1);
+}
+
+static inline size_t heap_commit(size_t size) {
+  return size < HEAP_COMMIT ? size : HEAP_COMMIT;
+}
+
+// map size bytes at addr without backing them and make the first
+// heap_commit(size) of them usable
+static void* reserve_heap(void* addr, size_t size) {
+  void* p = mmap(addr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED || mprotect(p, heap_commit(size), PROT_READ | PROT_WRITE)) {
+    return MAP_FAILED;
+  }
+  return p;
 }
 
 __attribute__((visibility("default")))
@@ -459,38 +663,173 @@ void __ds_init() {
   //  DEBUG("unsafe stack bottom: %p\n", (char*)unsafe_stack_bottom);
   //}
 
-  size_t UNSAFE_HEAP_HINT = UNSAFE_STACK_HINT - PAD - UNSAFE_HEAP_SIZE;
-  unsafe_heap = mmap((void*)UNSAFE_HEAP_HINT,
-                      UNSAFE_HEAP_SIZE,
-                      PROT_READ | PROT_WRITE,
-                      MAP_PRIVATE | MAP_ANONYMOUS,
-                      -1,
-                      0);
-  if (unsafe_heap == MAP_FAILED) {
+  // DATASHIELD_{UNSAFE,SAFE}_HEAP and DATASHIELD_{UNSAFE,SAFE}_STACK set
+  // the sizes below (with an optional k, m or g suffix)
+  unsafe_heap_size = env_size("DATASHIELD_UNSAFE_HEAP", UNSAFE_HEAP_SIZE);
+  size_t safe_heap_size = env_size("DATASHIELD_SAFE_HEAP", SAFE_HEAP_SIZE);
+  size_t unsafe_stack_size = env_size("DATASHIELD_UNSAFE_STACK", UNSAFE_STACK_SIZE);
+  safe_stack_size = env_size("DATASHIELD_SAFE_STACK", SAFE_STACK_SIZE);
+
+  char* lowfat = getenv("DATASHIELD_LOWFAT");
+  lowfat_safe_allocs = lowfat && strcmp(lowfat, "0");
+
+  uintptr_t safe_heap_start = ((uintptr_t)_end + PAGE - 1) & ~(PAGE - 1);
+  if (safe_heap_start < SAFE_ORIGIN) {
+    safe_heap_start = SAFE_ORIGIN; // no sensitive globals
+  }
+  if (safe_heap_start + SAFE_MSPACE_MIN > LOWFAT_BASE) {
+    fprintf(stderr, "the sensitive globals don't leave room for the safe heap!\n");
+    assert(0);
+  }
+  // the compact bounds can't describe a safe heap past the low-fat classes
+  if (safe_heap_size > LOWFAT_BASE - safe_heap_start) {
+    safe_heap_size = LOWFAT_BASE - safe_heap_start;
+  }
+  safe_heap = reserve_heap((void*)safe_heap_start, safe_heap_size);
+  if (safe_heap != (void*)safe_heap_start) {
+    // the compact bounds can't describe a safe heap anywhere else
+    fprintf(stderr, "mapping failed!\n");
+    assert(0);
+  }
+  // both regions are shared by all threads, so let dlmalloc lock them.
+  // they start out with HEAP_COMMIT bytes and grow into the rest
+  safe_region = create_mspace_with_base(safe_heap, heap_commit(safe_heap_size), 1);
+  mspace_set_reserve(safe_region, safe_heap_size - heap_commit(safe_heap_size));
+
+  if (lowfat_safe_allocs) {
+    void* lowfat_areas = mmap((void*)LOWFAT_BASE,
+                              LOWFAT_SIZE,
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                              -1,
+                              0);
+    if (lowfat_areas != (void*)LOWFAT_BASE) {
+      fprintf(stderr, "mapping failed!\n");
+      assert(0);
+    }
+  }
+
+  // the unsafe mappings come from the low 4GB above the brk heap, or all of
+  // it when the program image sits higher up (PIE)
+  uintptr_t unsafe_base = (((uintptr_t)sbrk(0) + PAGE - 1) & ~(PAGE - 1)) + BRK_RESERVE;
+  if (unsafe_base >= BOUNDARY - unsafe_stack_size) {
+    unsafe_base = PAGE;
+  }
+  __ds_va_init(safe_region, unsafe_base, BOUNDARY + 1);
+
+  // main runs on this stack, see __libc_start_main.  the page below it
+  // stays inaccessible so an overflow doesn't run into the unsafe heap
+  char* unsafe_stack = __ds_va_mmap(0,
+                                    unsafe_stack_size + PAD,
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS,
+                                    -1,
+                                    0);
+  if (unsafe_stack == MAP_FAILED) {
+    fprintf(stderr, "mapping stack failed!\n");
+    assert(0);
+  }
+  mprotect(unsafe_stack, PAD, PROT_NONE);
+  __ds_unsafe_stack_top = unsafe_stack + PAD + unsafe_stack_size;
+
+  unsafe_heap = __ds_va_mmap(0,
+                             unsafe_heap_size,
+                             PROT_NONE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                             -1,
+                             0);
+  if (unsafe_heap == MAP_FAILED ||
+      mprotect(unsafe_heap, heap_commit(unsafe_heap_size), PROT_READ | PROT_WRITE)) {
     fprintf(stderr, "mapping failed!\n");
     assert(0);
   } else {
-    assert((size_t)unsafe_heap+UNSAFE_HEAP_SIZE < BOUNDARY);
-    DEBUG("unsafe heap top: %p\n", (char*)unsafe_heap + UNSAFE_HEAP_SIZE);
+    assert((size_t)unsafe_heap+unsafe_heap_size <= BOUNDARY + 1);
+    DEBUG("unsafe heap top: %p\n", (char*)unsafe_heap + unsafe_heap_size);
   }
 
-  unsafe_region = create_mspace_with_base(unsafe_heap, UNSAFE_HEAP_SIZE, 0);
+  unsafe_region = create_mspace_with_base(unsafe_heap, heap_commit(unsafe_heap_size), 1);
+  mspace_set_reserve(unsafe_region, unsafe_heap_size - heap_commit(unsafe_heap_size));
 
-  safe_heap = mmap((void*)SAFE_HEAP_HINT,
-                      SAFE_REGION_SIZE,
-                      PROT_READ | PROT_WRITE,
-                      //MAP_PRIVATE | MAP_ANONYMOUS | MAP_GROWSDOWN, // it seems like MAP_GROWNSDOWN doesn't do anything?
-                      MAP_PRIVATE | MAP_ANONYMOUS,
-                      -1,
-                      0);
-  if (safe_heap == MAP_FAILED) {
+  // the table is zero (empty bounds) until written, so there's no need to
+  // reserve swap for it.  the pass hardcodes its address, and it only
+  // needs to cover as far up as safe objects can be
+  uintptr_t safe_end = lowfat_safe_allocs ? SAFE_HEAP_END : safe_heap_start + safe_heap_size;
+  n_table_entries = (safe_end - SAFE_ORIGIN) / 8;
+  size_t table_size = (n_table_entries * sizeof(__ds_table_entry) + PAGE - 1) & ~(PAGE - 1);
+  __ds_table = mmap((void*)METADATA_TABLE_HINT,
+                    table_size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                    -1,
+                    0);
+  if (__ds_table != (void*)METADATA_TABLE_HINT) {
     fprintf(stderr, "mapping failed!\n");
     assert(0);
   }
-  safe_region = create_mspace_with_base(safe_heap, SAFE_HEAP_SIZE, 0);
+  char* thp = getenv("DATASHIELD_SHADOW_THP");
+  if (thp && strcmp(thp, "0")) {
+    madvise(__ds_table, table_size < SHADOW_HOT_SIZE ? table_size : SHADOW_HOT_SIZE, MADV_HUGEPAGE);
+  }
+  for (__ds_global_bounds_t* g = __start___ds_global_bounds; g < __stop___ds_global_bounds; ++g) {
+    // globals the linker script left below the boundary have no entries
+    if ((uintptr_t)g->ptr >= SAFE_ORIGIN) {
+      __ds_table[__ds_hash(g->ptr)] = __ds_encode_bounds(g->bounds);
+    }
+  }
+
+  char* zero = getenv("DATASHIELD_ZERO_UNSAFE");
+  zero_unsafe_allocs = !zero || strcmp(zero, "0");
 
-  __ds_table = (__ds_table_entry*) __ds_safe_malloc(sizeof(__ds_table_entry) * N_TABLE_ENTRIES);
+  // DATASHIELD_THREAD_CACHE=0 sends every request straight to the mspaces
+  char* tc = getenv("DATASHIELD_THREAD_CACHE");
+  __ds_tc_init(unsafe_region, unsafe_heap, unsafe_heap_size,
+               safe_region, safe_heap, safe_heap_size, !tc || strcmp(tc, "0"));
 
+  __ds_lowfat_init(safe_region, lowfat_safe_allocs);
+
+  __ds_thread_init();
+}
+
+__attribute__((visibility("default")))
+void __ds_thread_init() {
+  // the safe stack has to be in the safe heap for the table to cover it,
+  // its guard is the first pages of the block
+  __ds_safe_stack_bottom = mspace_memalign(safe_region, PAGE, SAFE_STACK_GUARD + safe_stack_size);
+  if (!__ds_safe_stack_bottom ||
+      mprotect(__ds_safe_stack_bottom, SAFE_STACK_GUARD, PROT_NONE)) {
+    fprintf(stderr, "could not allocate the safe stack!\n");
+    assert(0);
+  }
+  __ds_safe_stack_ptr = (char*)__ds_safe_stack_bottom + SAFE_STACK_GUARD + safe_stack_size;
+  DEBUG("safe stack top: %p\n", __ds_safe_stack_ptr);
+
+  __ds_fn_args = mspace_malloc(safe_region, sizeof(__ds_bounds_t) * N_ARG_ENTRIES);
+  if (!__ds_fn_args) {
+    fprintf(stderr, "could not allocate the fn args array!\n");
+    assert(0);
+  }
+  // the thread's start routine gets its arguments from pthread_create,
+  // which doesn't pass bounds, so start out like after a get
+  for (size_t i = 0; i < N_ARG_ENTRIES; ++i) {
+    __ds_fn_args[i] = __ds_unsafe_region_bounds;
+  }
+
+  __ds_tc_thread_init();
+  __ds_lowfat_thread_init();
+}
+
+__attribute__((visibility("default")))
+void __ds_thread_exit() {
+  __ds_tc_thread_exit();
+  __ds_lowfat_thread_exit();
+  // dlmalloc writes into the block once it is free
+  mprotect(__ds_safe_stack_bottom, SAFE_STACK_GUARD, PROT_READ | PROT_WRITE);
+  __ds_reclaim_shadow(__ds_safe_stack_bottom, SAFE_STACK_GUARD + safe_stack_size);
+  mspace_free(safe_region, __ds_safe_stack_bottom);
+  __ds_safe_stack_bottom = 0;
+  __ds_safe_stack_ptr = 0;
+  mspace_free(safe_region, __ds_fn_args);
+  __ds_fn_args = 0;
 }
 __attribute__((visibility("default")))
 void __ds_abort_debug(__ds_bounds_t bounds, void* ptr, void* bottom, char* msg, size_t id) {
@@ -518,23 +857,33 @@ void __ds_metadata_copy_debug(unsigned char* dst, unsigned char* src, size_t siz
     size_t dst_hash = __ds_hash((void*)(dst+i*sizeof(void*)));
     size_t src_hash = __ds_hash((void*)(src+i*sizeof(void*)));
     DEBUG("dst hash: %li, src hash: %li\n", dst_hash, src_hash);
-    assert(dst_hash > 0);
-    assert(src_hash > 0);
-    assert(dst_hash < N_TABLE_ENTRIES);
-    assert(src_hash < N_TABLE_ENTRIES);
+    assert(dst_hash < n_table_entries);
+    assert(src_hash < n_table_entries);
     DEBUG("(metadata copy) %p <= %p : [%p, %p)\n",
           dst+i*sizeof(void*),
           src+i*sizeof(void*),
-          __ds_table[src_hash].bounds.base,
-          __ds_table[src_hash].bounds.last);
+          __ds_decode_bounds(__ds_table[src_hash]).base,
+          __ds_decode_bounds(__ds_table[src_hash]).last);
     //__ds_table[dst_hash].ptrAddr = __ds_table[src_hash].ptrAddr;
-    __ds_table[dst_hash].bounds.base = __ds_table[src_hash].bounds.base;
-    __ds_table[dst_hash].bounds.last = __ds_table[src_hash].bounds.last;
+    __ds_table[dst_hash] = __ds_table[src_hash];
   }
   return;
 
 }
 
+// the entries of a range are contiguous like the range itself, word i of
+// dst gets the entry of word i of src.  most copies are a struct or two,
+// which aren't worth the call to memmove
+static inline void __ds_copy_entries(__ds_table_entry* dst, __ds_table_entry* src, size_t n) {
+  if (n <= 8 && (dst + n <= src || src + n <= dst)) {
+    for (size_t i = 0; i < n; ++i) {
+      dst[i] = src[i];
+    }
+  } else {
+    memmove(dst, src, n * sizeof(__ds_table_entry));
+  }
+}
+
 __attribute__((visibility("default")))
 void __ds_metadata_copy(unsigned char* dst, unsigned char* src, size_t size) {
   // when we call memcpy on a struct, we need to copy the member pointer bounds as well
@@ -543,24 +892,33 @@ void __ds_metadata_copy(unsigned char* dst, unsigned char* src, size_t size) {
   // hack because we don't move global variables
   //if ((size_t)src < BOUNDARY) { return; }
   size_t n_ptrs = size/sizeof(void*);
-  for (size_t i = 0; i < n_ptrs; ++i) {
-    size_t dst_hash = __ds_hash((void*)(dst+i*sizeof(void*)));
-    size_t src_hash = __ds_hash((void*)(src+i*sizeof(void*)));
-    assert(dst_hash > 0);
-    assert(src_hash > 0);
-    assert(dst_hash < N_TABLE_ENTRIES);
-    assert(src_hash < N_TABLE_ENTRIES);
-    DEBUG("dst hash: %li, src hash: %li\n", dst_hash, src_hash);
-    DEBUG("(metadata copy) %p <= %p : [%p, %p)\n",
-          dst+i*sizeof(void*),
-          src+i*sizeof(void*),
-          __ds_table[src_hash].bounds.base,
-          __ds_table[src_hash].bounds.last);
-    //__ds_table[dst_hash].ptrAddr = __ds_table[src_hash].ptrAddr;
-    __ds_table[dst_hash].bounds.base = __ds_table[src_hash].bounds.base;
-    __ds_table[dst_hash].bounds.last = __ds_table[src_hash].bounds.last;
+  if (!n_ptrs) { return; }
+  size_t dst_hash = __ds_hash(dst);
+  size_t src_hash = __ds_hash(src);
+  assert(dst_hash + n_ptrs <= n_table_entries);
+  assert(src_hash + n_ptrs <= n_table_entries);
+  __ds_copy_entries(&__ds_table[dst_hash], &__ds_table[src_hash], n_ptrs);
+}
+
+// for types with few pointers: bit i of mask is set when word i of every
+// stride bytes holds one (see insertMetadataCopy in DataShield.cpp)
+__attribute__((visibility("default")))
+void __ds_metadata_copy_layout(unsigned char* dst, unsigned char* src, size_t size,
+                               uint64_t mask, size_t stride) {
+  DEBUG("(metadata copy) %p <= %p x %li, mask %lx / %li\n", dst, src, size, mask, stride);
+  size_t words = stride / sizeof(void*);
+  size_t n = size / stride;
+  if (!n) { return; }
+  __ds_table_entry* d = &__ds_table[__ds_hash(dst)];
+  __ds_table_entry* s = &__ds_table[__ds_hash(src)];
+  assert(d + n*words <= __ds_table + n_table_entries);
+  assert(s + n*words <= __ds_table + n_table_entries);
+  for (size_t i = 0; i < n; ++i, d += words, s += words) {
+    for (uint64_t m = mask; m; m &= m - 1) {
+      int w = __builtin_ctzll(m);
+      d[w] = s[w];
+    }
   }
-  return;
 }
 
 __attribute__((visibility("default")))
@@ -572,28 +930,27 @@ void __ds_safe_memcpy(unsigned char* dst, unsigned char* src, size_t size) {
 // non debug bounds functions
 __attribute__((visibility("default")))
 void __ds_set_fn_arg_bounds(size_t i, __ds_bounds_t bounds) {
-  __ds_fn_args_array[i] = bounds;
+  __ds_fn_args[i] = bounds;
 }
 
 __attribute__((visibility("default")))
 __ds_bounds_t __ds_get_fn_arg_bounds(size_t i) {
-  __ds_bounds_t b = __ds_fn_args_array[i];
-  __ds_fn_args_array[i] = __ds_unsafe_region_bounds;
+  __ds_bounds_t b = __ds_fn_args[i];
+  __ds_fn_args[i] = __ds_unsafe_region_bounds;
   return b;
 }
 
 __attribute__((visibility("default")))
 __ds_bounds_t __ds_get_bounds(void* ptrAddr) {
   size_t hash = __ds_hash(ptrAddr);
-  __ds_bounds_t bounds = __ds_table[hash].bounds;
-  return bounds;
+  return __ds_decode_bounds(__ds_table[hash]);
 }
 
 __attribute__((visibility("default")))
 void __ds_set_bounds(void *ptrAddr, __ds_bounds_t bounds) {
   size_t hash = __ds_hash(ptrAddr);
   //__ds_table[hash].ptrAddr = ptrAddr;
-  __ds_table[hash].bounds = bounds;
+  __ds_table[hash] = __ds_encode_bounds(bounds);
 }
 
 __attribute__((visibility("default")))
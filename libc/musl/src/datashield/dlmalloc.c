@@ -699,6 +699,9 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
 #define MAX_RELEASE_CHECK_RATE MAX_SIZE_T
 #endif /* HAVE_MMAP */
 #endif /* MAX_RELEASE_CHECK_RATE */
+#ifndef RESERVE_COMMIT_MIN /* DataShield: see mspace_set_reserve */
+#define RESERVE_COMMIT_MIN ((size_t)16U * (size_t)1024U * (size_t)1024U)
+#endif  /* RESERVE_COMMIT_MIN */
 #ifndef USE_BUILTIN_FFS
 #define USE_BUILTIN_FFS 0
 #endif  /* USE_BUILTIN_FFS */
@@ -1397,6 +1400,21 @@ DLMALLOC_EXPORT struct mallinfo mspace_mallinfo(mspace msp);
 */
 DLMALLOC_EXPORT size_t mspace_usable_size(const void* mem);
 
+/*
+  mspace_dirty_size(void* mem) returns how many leading bytes of a just
+  allocated mem may be non-zero (DataShield extension).
+*/
+DLMALLOC_EXPORT size_t mspace_dirty_size(const void* mem);
+
+/*
+  mspace_set_reserve(mspace msp, size_t size) lets a space made with
+  create_mspace_with_base grow by up to size bytes right after its base.
+  That range has to be mapped PROT_NONE by the caller and is made
+  writable as the space needs it.  The space never maps memory anywhere
+  else afterwards (DataShield extension).
+*/
+DLMALLOC_EXPORT int mspace_set_reserve(mspace msp, size_t size);
+
 /*
   mspace_malloc_stats behaves as malloc_stats, but reports
   properties of the given space.
@@ -2242,6 +2260,7 @@ typedef unsigned int flag_t;           /* The type of various bit flag sets */
   use, unless mmapped, in which case both bits are cleared.
 
   FLAG4_BIT is not used by this malloc, but might be useful in extensions.
+  (DataShield uses it on chunks that were split off top, see mark_clear.)
 */
 
 #define PINUSE_BIT          (SIZE_T_ONE)
@@ -2300,6 +2319,16 @@ typedef unsigned int flag_t;           /* The type of various bit flag sets */
 #define calloc_must_clear(p) (1)
 #endif /* MMAP_CLEARS */
 
+/*
+  DataShield: how many leading bytes of a just allocated chunk may be
+  non-zero.  A chunk split off top with FLAG4 set was never handed out
+  before, except for the dirty prefix whose length mark_clear stored in
+  its first word (which is zero when the whole chunk is untouched).
+*/
+#define dirty_size(p)\
+  (!calloc_must_clear(p)? 0 :\
+   flag4inuse(p)? *(size_t*)chunk2mem(p) : chunksize(p) - overhead_for(p))
+
 /* ---------------------- Overlaid data structures ----------------------- */
 
 /*
@@ -2598,6 +2627,9 @@ struct malloc_state {
   MLOCK_T    mutex;     /* locate lock among fields that rarely change */
 #endif /* USE_LOCKS */
   msegment   seg;
+  char*      fresh;     /* nothing at or above was handed out yet */
+  char*      reserve_top; /* start of what is still uncommitted */
+  char*      reserve_end; /* zero unless mspace_set_reserve was called */
   void*      extp;      /* Unused but available for extensions */
   size_t     exts;
 };
@@ -3285,7 +3317,7 @@ static void do_check_free_chunk(mstate m, mchunkptr p) {
 static void do_check_malloced_chunk(mstate m, void* mem, size_t s) {
   if (mem != 0) {
     mchunkptr p = mem2chunk(mem);
-    size_t sz = p->head & ~INUSE_BITS;
+    size_t sz = chunksize(p);
     do_check_inuse_chunk(m, p);
     assert((sz & CHUNK_ALIGN_MASK) == 0);
     assert(sz >= MIN_CHUNK_SIZE);
@@ -3890,6 +3922,24 @@ static mchunkptr mmap_resize(mstate m, mchunkptr oldp, size_t nb, int flags) {
 
 /* -------------------------- mspace management -------------------------- */
 
+/*
+  DataShield: p was just split off top and next is the new top.  If that
+  moved top past the untouched space, flag p and store how much of it was
+  handed out before, so calloc only has to clear that part.
+*/
+static void mark_clear(mstate m, mchunkptr p, mchunkptr next) {
+  char* mem = (char*)chunk2mem(p);
+  if ((char*)chunk2mem(next) > m->fresh) {
+    if (mem < m->fresh) {
+      size_t dirty = m->fresh - mem;
+      *(size_t*)mem = dirty < SIZE_T_SIZE? SIZE_T_SIZE : dirty;
+    }
+    set_flag4(p);
+    /* top's header is written over again whenever top moves */
+    m->fresh = (char*)chunk2mem(next);
+  }
+}
+
 /* Initialize top chunk and its size */
 static void init_top(mstate m, mchunkptr p, size_t psize) {
   /* Ensure alignment */
@@ -4139,7 +4189,20 @@ static void* sys_alloc(mstate m, size_t nb) {
     RELEASE_MALLOC_GLOBAL_LOCK();
   }
 
-  if (HAVE_MMAP && tbase == CMFAIL) {  /* Try MMAP */
+  if (tbase == CMFAIL && m->reserve_end != 0) { /* Commit reserved space */
+    size_t csize = (asize < RESERVE_COMMIT_MIN)? RESERVE_COMMIT_MIN : asize;
+    size_t left = (size_t)(m->reserve_end - m->reserve_top);
+    if (csize > left)
+      csize = left;
+    if (csize >= asize &&
+        mprotect(m->reserve_top, csize, PROT_READ|PROT_WRITE) == 0) {
+      tbase = m->reserve_top;
+      tsize = csize;
+      m->reserve_top += csize;
+    }
+  }
+
+  if (HAVE_MMAP && tbase == CMFAIL && m->reserve_end == 0) {  /* Try MMAP */
     char* mp = (char*)(CALL_MMAP(asize));
     if (mp != CMFAIL) {
       tbase = mp;
@@ -4170,8 +4233,8 @@ static void* sys_alloc(mstate m, size_t nb) {
 
     if ((m->footprint += tsize) > m->max_footprint)
       m->max_footprint = m->footprint;
-
     if (!is_initialized(m)) { /* first-time initialization */
+      m->fresh = (char*)MAX_SIZE_T;
       if (m->least_addr == 0 || tbase < m->least_addr)
         m->least_addr = tbase;
       m->seg.base = tbase;
@@ -4203,9 +4266,14 @@ static void* sys_alloc(mstate m, size_t nb) {
           (sp->sflags & USE_MMAP_BIT) == mmap_flag &&
           segment_holds(sp, m->top)) { /* append */
         sp->size += tsize;
+        /* DataShield: the old fencepost ends up inside top, above fresh,
+           where mark_clear expects only zeroes */
+        chunk_plus_offset(m->top, m->topsize)->head = 0;
         init_top(m, m->top, m->topsize + tsize);
       }
       else {
+        /* segments may come in below top, stop tracking untouched space */
+        m->fresh = (char*)MAX_SIZE_T;
         if (tbase < m->least_addr)
           m->least_addr = tbase;
         sp = &m->seg;
@@ -4835,6 +4903,8 @@ static mchunkptr try_realloc_chunk(mstate m, mchunkptr p, size_t nb,
         newtop->head = newtopsize |PINUSE_BIT;
         m->top = newtop;
         m->topsize = newtopsize;
+        if ((char*)chunk2mem(newtop) > m->fresh)
+          m->fresh = (char*)chunk2mem(newtop);
         newp = p;
       }
     }
@@ -4905,6 +4975,7 @@ static void* internal_memalign(mstate m, size_t alignment, size_t bytes) {
     mem = internal_malloc(m, req);
     if (mem != 0) {
       mchunkptr p = mem2chunk(mem);
+      int clear = flag4inuse(p) && *(size_t*)mem == 0;
       if (PREACTION(m))
         return 0;
       if ((((size_t)(mem)) & (alignment - 1)) != 0) { /* misaligned */
@@ -4949,6 +5020,9 @@ static void* internal_memalign(mstate m, size_t alignment, size_t bytes) {
         }
       }
 
+      /* the aligned part of an untouched chunk is still untouched */
+      if (clear)
+        set_flag4(p);
       mem = chunk2mem(p);
       assert (chunksize(p) >= nb);
       assert(((size_t)mem & (alignment - 1)) == 0);
@@ -5413,6 +5487,7 @@ static mstate init_user_mstate(char* tbase, size_t tsize) {
   init_bins(m);
   mn = next_chunk(mem2chunk(m));
   init_top(m, mn, (size_t)((tbase + tsize) - (char*)mn) - TOP_FOOT_SIZE);
+  m->fresh = (char*)chunk2mem(m->top);
   check_top_chunk(m, m->top);
   return m;
 }
@@ -5450,6 +5525,23 @@ mspace create_mspace_with_base(void* base, size_t capacity, int locked) {
   return (mspace)m;
 }
 
+int mspace_set_reserve(mspace msp, size_t size) {
+  int ret = 0;
+  mstate ms = (mstate)msp;
+  if (!PREACTION(ms)) {
+    if (ms->seg.next == 0 && ms->reserve_end == 0) {
+      ms->reserve_top = ms->seg.base + ms->seg.size;
+      ms->reserve_end = ms->reserve_top + size;
+      /* let the reserve extend the base segment in place */
+      ms->seg.sflags &= ~EXTERN_BIT;
+      disable_mmap(ms);
+      ret = 1;
+    }
+    POSTACTION(ms);
+  }
+  return ret;
+}
+
 int mspace_track_large_chunks(mspace msp, int enable) {
   int ret = 0;
   mstate ms = (mstate)msp;
@@ -5593,6 +5685,7 @@ void* mspace_malloc(mspace msp, size_t bytes) {
       mchunkptr r = ms->top = chunk_plus_offset(p, nb);
       r->head = rsize | PINUSE_BIT;
       set_size_and_pinuse_of_inuse_chunk(ms, p, nb);
+      mark_clear(ms, p, r);
       mem = chunk2mem(p);
       check_top_chunk(ms, ms->top);
       check_malloced_chunk(ms, mem, nb);
@@ -5725,8 +5818,10 @@ void* mspace_calloc(mspace msp, size_t n_elements, size_t elem_size) {
       req = MAX_SIZE_T; /* force downstream failure on overflow */
   }
   mem = internal_malloc(ms, req);
-  if (mem != 0 && calloc_must_clear(mem2chunk(mem)))
-    memset(mem, 0, req);
+  if (mem != 0) {
+    size_t dirty = dirty_size(mem2chunk(mem));
+    memset(mem, 0, dirty < req? dirty : req);
+  }
   return mem;
 }
 
@@ -5955,6 +6050,15 @@ struct mallinfo mspace_mallinfo(mspace msp) {
 }
 #endif /* NO_MALLINFO */
 
+size_t mspace_dirty_size(const void* mem) {
+  if (mem != 0) {
+    mchunkptr p = mem2chunk(mem);
+    if (is_inuse(p))
+      return dirty_size(p);
+  }
+  return 0;
+}
+
 size_t mspace_usable_size(const void* mem) {
   if (mem != 0) {
     mchunkptr p = mem2chunk(mem);
@@ -0,0 +1,212 @@
+#ifdef __USE_DATASHIELD
+#include <string.h>
+#include "atomic.h"
+#include "lowfat.h"
+
+// every class has a global area that hands out runs of fresh slots and
+// keeps a free list, both behind a spin lock.  threads carve their slots
+// from a run of their own and keep up to CACHE_MAX freed objects per class
+// before giving half of them back, so most requests never take the lock.
+// an object goes onto the list of whichever thread frees it.
+//
+// the free list links and the caches are in the safe region like the
+// objects themselves, so masked stores can't reach them
+
+#define RUN_SIZE (1ull << 16)
+#define CACHE_MAX (64)
+#define REFILL_MAX (CACHE_MAX / 2)
+
+// what is left of a run when its thread exits, kept at the run's start
+struct lf_run {
+  char* end;
+  struct lf_run* next;
+};
+
+struct lf_area {
+  char *bump, *end;
+  void* free;
+  struct lf_run* runs;
+  volatile int lock;
+};
+
+struct lf_cache {
+  void* free[LOWFAT_N_CLASSES];
+  size_t n_free[LOWFAT_N_CLASSES];
+  char *bump[LOWFAT_N_CLASSES], *end[LOWFAT_N_CLASSES];
+};
+
+static struct lf_area areas[LOWFAT_N_CLASSES];
+static mspace meta_space;
+static int lf_enabled;
+
+static __thread struct lf_cache* __ds_lf_cache __attribute__((tls_model("initial-exec"))) = 0;
+
+static inline void lock(volatile int* l) {
+  while (a_swap(l, 1)) { a_spin(); }
+}
+
+static inline void unlock(volatile int* l) {
+  a_store(l, 0);
+}
+
+// one byte more than asked for, so a pointer one past the end of the
+// object still computes the object's bounds and not its neighbour's
+static inline int size_class(size_t n) {
+  if (n < LOWFAT_MIN_SIZE) { return 0; }
+  return 64 - __builtin_clzll(n) - LOWFAT_MIN_SHIFT;
+}
+
+static inline size_t class_size(int klass) {
+  return LOWFAT_MIN_SIZE << klass;
+}
+
+static inline int class_of(const void* ptr) {
+  return ((uintptr_t)ptr - LOWFAT_BASE) >> LOWFAT_AREA_SHIFT;
+}
+
+void __ds_lowfat_init(mspace meta, int enabled) {
+  meta_space = meta;
+  lf_enabled = enabled;
+  for (int k = 0; k < LOWFAT_N_CLASSES; ++k) {
+    areas[k].bump = (char*)(uintptr_t)(LOWFAT_BASE + k*LOWFAT_AREA_SIZE);
+    areas[k].end = areas[k].bump + LOWFAT_AREA_SIZE;
+  }
+}
+
+void __ds_lowfat_thread_init(void) {
+  if (!lf_enabled) { return; }
+  __ds_lf_cache = mspace_calloc(meta_space, 1, sizeof(struct lf_cache));
+}
+
+// move the first n objects of the cache's list for klass to the area
+static void flush(struct lf_cache* c, int klass, size_t n) {
+  void* head = c->free[klass];
+  void* tail = head;
+  for (size_t i = 1; i < n; ++i) {
+    tail = *(void**)tail;
+  }
+  c->free[klass] = *(void**)tail;
+  c->n_free[klass] -= n;
+  struct lf_area* a = &areas[klass];
+  lock(&a->lock);
+  *(void**)tail = a->free;
+  a->free = head;
+  unlock(&a->lock);
+}
+
+void __ds_lowfat_thread_exit(void) {
+  struct lf_cache* c = __ds_lf_cache;
+  if (!c) { return; }
+  __ds_lf_cache = 0;
+  for (int k = 0; k < LOWFAT_N_CLASSES; ++k) {
+    if (c->n_free[k]) {
+      flush(c, k, c->n_free[k]);
+    }
+    if (c->bump[k] + class_size(k) <= c->end[k]) {
+      struct lf_area* a = &areas[k];
+      struct lf_run* run = (struct lf_run*)c->bump[k];
+      run->end = c->end[k];
+      lock(&a->lock);
+      run->next = a->runs;
+      a->runs = run;
+      unlock(&a->lock);
+    }
+  }
+  mspace_free(meta_space, c);
+}
+
+// give the cache objects of klass to reuse or a new run to carve them from
+static int refill(struct lf_cache* c, int klass) {
+  struct lf_area* a = &areas[klass];
+  size_t size = class_size(klass);
+  size_t run_size = size < RUN_SIZE ? RUN_SIZE : size;
+  int ok = 1;
+  lock(&a->lock);
+  if (a->free) {
+    void* head = a->free;
+    void* tail = head;
+    size_t n = 1;
+    while (n < REFILL_MAX && *(void**)tail) {
+      tail = *(void**)tail;
+      ++n;
+    }
+    a->free = *(void**)tail;
+    *(void**)tail = 0;
+    c->free[klass] = head;
+    c->n_free[klass] = n;
+  } else if (a->runs) {
+    struct lf_run* run = a->runs;
+    a->runs = run->next;
+    c->bump[klass] = (char*)run;
+    c->end[klass] = run->end;
+    // the rest of the run was never handed out
+    memset(run, 0, sizeof(struct lf_run));
+  } else if (a->bump + run_size <= a->end) {
+    c->bump[klass] = a->bump;
+    c->end[klass] = a->bump + run_size;
+    a->bump += run_size;
+  } else {
+    ok = 0;
+  }
+  unlock(&a->lock);
+  return ok;
+}
+
+// *dirty is set when the object may hold anything but zeros
+static void* lowfat_alloc(size_t n, int* dirty) {
+  struct lf_cache* c = __ds_lf_cache;
+  if (!c || n >= LOWFAT_MAX_SIZE) { return 0; }
+  int klass = size_class(n);
+  size_t size = class_size(klass);
+  for (;;) {
+    void* p = c->free[klass];
+    if (p) {
+      c->free[klass] = *(void**)p;
+      --c->n_free[klass];
+      *dirty = 1;
+      return p;
+    }
+    if (c->bump[klass] + size <= c->end[klass]) {
+      p = c->bump[klass];
+      c->bump[klass] += size;
+      *dirty = 0;
+      return p;
+    }
+    if (!refill(c, klass)) {
+      return 0;
+    }
+  }
+}
+
+void* __ds_lowfat_malloc(size_t n) {
+  int dirty;
+  return lowfat_alloc(n, &dirty);
+}
+
+void* __ds_lowfat_calloc(size_t n) {
+  int dirty;
+  void* p = lowfat_alloc(n, &dirty);
+  if (p && dirty) { memset(p, 0, n); }
+  return p;
+}
+
+void __ds_lowfat_free(void* ptr) {
+  int klass = class_of(ptr);
+  struct lf_cache* c = __ds_lf_cache;
+  if (!c) {
+    // a thread that already gave its cache back
+    struct lf_area* a = &areas[klass];
+    lock(&a->lock);
+    *(void**)ptr = a->free;
+    a->free = ptr;
+    unlock(&a->lock);
+    return;
+  }
+  *(void**)ptr = c->free[klass];
+  c->free[klass] = ptr;
+  if (++c->n_free[klass] > CACHE_MAX) {
+    flush(c, klass, CACHE_MAX / 2);
+  }
+}
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef __DS_LOWFAT_H
+#define __DS_LOWFAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "dlmalloc.h"
+
+// the top of the safe heap is split into one area per power of two size
+// class, aligned to the area size.  every object there fills a whole slot
+// of its class, so its bounds follow from the pointer alone:
+//   klass = (p - LOWFAT_BASE) >> LOWFAT_AREA_SHIFT
+//   size  = LOWFAT_MIN_SIZE << klass
+//   base  = p & -size
+// the pass emits the same computation (see -datashield-lowfat-bounds),
+// keep the constants in sync with DataShield.cpp
+#define LOWFAT_MIN_SHIFT (4)
+#define LOWFAT_MIN_SIZE (1ull << LOWFAT_MIN_SHIFT)
+#define LOWFAT_N_CLASSES (16)
+#define LOWFAT_MAX_SIZE (LOWFAT_MIN_SIZE << (LOWFAT_N_CLASSES - 1))
+#define LOWFAT_AREA_SHIFT (26)
+#define LOWFAT_AREA_SIZE (1ull << LOWFAT_AREA_SHIFT)
+#define LOWFAT_SIZE (LOWFAT_AREA_SIZE * LOWFAT_N_CLASSES)
+#define LOWFAT_BASE ((1ull << 32) + (1ull << 32) - LOWFAT_SIZE)
+
+static inline int __ds_is_lowfat(const void* ptr) {
+  return (uintptr_t)ptr - LOWFAT_BASE < LOWFAT_SIZE;
+}
+
+static inline size_t __ds_lowfat_size(const void* ptr) {
+  return LOWFAT_MIN_SIZE << (((uintptr_t)ptr - LOWFAT_BASE) >> LOWFAT_AREA_SHIFT);
+}
+
+void  __ds_lowfat_init(mspace meta, int enabled);
+void  __ds_lowfat_thread_init(void);
+void  __ds_lowfat_thread_exit(void);
+
+// return 0 when n doesn't fit a class or its area is used up, the
+// caller falls back to the regular safe heap then
+void* __ds_lowfat_malloc(size_t n);
+void* __ds_lowfat_calloc(size_t n);
+void  __ds_lowfat_free(void* ptr);
+
+#endif
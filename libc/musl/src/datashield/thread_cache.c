@@ -0,0 +1,348 @@
+#ifdef __USE_DATASHIELD
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include "atomic.h"
+#include "thread_cache.h"
+
+// Every thread has a heap with one list of slabs per size class and region.
+// A slab is a SLAB_SIZE aligned block carved out of the region's mspace and
+// only its owner allocates from it or frees into its free list, so the fast
+// paths take no locks.  Other threads push the objects they free onto the
+// slab's remote list with a CAS, and the owner takes the whole list back
+// when it runs out of local free objects.
+//
+// The slab headers live in the safe region and are found through a per
+// region table indexed by the slab number, so nothing the allocator relies
+// on is kept inline in the unsafe region except the free list links.
+
+#define SLAB_SHIFT (16)
+#define SLAB_SIZE (1ull << SLAB_SHIFT)
+#define CLASS_SHIFT (4)
+#define SMALL_MAX (1024)
+#define N_CLASSES (SMALL_MAX >> CLASS_SHIFT)
+
+struct ds_heap;
+
+struct ds_slab {
+  struct ds_heap* owner; // 0 once the owner exited
+  struct ds_slab *prev, *next;
+  void* free;
+  void* volatile remote;
+  char *start, *bump, *end;
+  size_t size;
+  size_t used; // handed out and not back on the local free list
+  int clear; // the bump space was never handed out and is still zero
+  int region;
+  int klass;
+};
+
+struct ds_heap {
+  struct ds_slab* slabs[DS_N_REGIONS][N_CLASSES];
+};
+
+struct ds_region {
+  mspace space;
+  uintptr_t first; // slab number of the region's first slab
+  size_t n_slabs;
+  struct ds_slab** slabs;
+  // slabs of exited threads that still had live objects
+  struct ds_slab* abandoned[N_CLASSES];
+  volatile int lock;
+};
+
+static struct ds_region regions[DS_N_REGIONS];
+static mspace meta_space;
+static int tc_enabled;
+
+static __thread struct ds_heap* __ds_heap __attribute__((tls_model("initial-exec"))) = 0;
+
+// region locks always spin, single threaded or not, unlike musl's LOCK()
+static inline void lock(volatile int* l) {
+  while (a_swap(l, 1)) { a_spin(); }
+}
+
+static inline void unlock(volatile int* l) {
+  a_store(l, 0);
+}
+
+static inline size_t size_class(size_t n) {
+  return n ? (n - 1) >> CLASS_SHIFT : 0;
+}
+
+static inline struct ds_slab* lookup_slab(struct ds_region* r, void* ptr) {
+  size_t idx = ((uintptr_t)ptr >> SLAB_SHIFT) - r->first;
+  return idx < r->n_slabs ? r->slabs[idx] : 0;
+}
+
+static inline size_t slab_index(struct ds_region* r, struct ds_slab* s) {
+  return ((uintptr_t)s->start >> SLAB_SHIFT) - r->first;
+}
+
+static void link_front(struct ds_slab** list, struct ds_slab* s) {
+  s->prev = 0;
+  s->next = *list;
+  if (s->next) { s->next->prev = s; }
+  *list = s;
+}
+
+static void unlink_slab(struct ds_slab** list, struct ds_slab* s) {
+  if (s->prev) { s->prev->next = s->next; } else { *list = s->next; }
+  if (s->next) { s->next->prev = s->prev; }
+  s->prev = s->next = 0;
+}
+
+// move the objects other threads freed onto the local free list
+static void collect_remote(struct ds_slab* s) {
+  void* list;
+  do {
+    list = s->remote;
+  } while (list && a_cas_p(&s->remote, list, 0) != list);
+  if (!list) { return; }
+  size_t n = 1;
+  void* tail = list;
+  while (*(void**)tail) {
+    tail = *(void**)tail;
+    ++n;
+  }
+  *(void**)tail = s->free;
+  s->free = list;
+  s->used -= n;
+}
+
+static inline int slab_has_room(struct ds_slab* s) {
+  return s->free || s->bump + s->size <= s->end || s->remote;
+}
+
+static inline void* slab_pop(struct ds_slab* s, int* dirty) {
+  void* p = s->free;
+  *dirty = 1;
+  if (p) {
+    s->free = *(void**)p;
+  } else if (s->bump + s->size <= s->end) {
+    p = s->bump;
+    s->bump += s->size;
+    *dirty = !s->clear;
+  } else if (s->remote) {
+    collect_remote(s);
+    p = s->free;
+    s->free = *(void**)p;
+  } else {
+    return 0;
+  }
+  ++s->used;
+  return p;
+}
+
+static struct ds_slab* new_slab(int region, int klass) {
+  struct ds_region* r = &regions[region];
+  struct ds_slab* s = mspace_malloc(meta_space, sizeof(struct ds_slab));
+  if (!s) { return 0; }
+  s->start = mspace_memalign(r->space, SLAB_SIZE, SLAB_SIZE);
+  if (!s->start) {
+    mspace_free(meta_space, s);
+    return 0;
+  }
+  s->owner = 0;
+  s->prev = s->next = 0;
+  s->free = 0;
+  s->remote = 0;
+  s->bump = s->start;
+  s->end = s->start + SLAB_SIZE;
+  s->size = (size_t)(klass + 1) << CLASS_SHIFT;
+  s->used = 0;
+  s->clear = mspace_dirty_size(s->start) == 0;
+  s->region = region;
+  s->klass = klass;
+  r->slabs[slab_index(r, s)] = s;
+  return s;
+}
+
+static void release_slab(struct ds_slab* s) {
+  struct ds_region* r = &regions[s->region];
+  r->slabs[slab_index(r, s)] = 0;
+  mspace_free(r->space, s->start);
+  mspace_free(meta_space, s);
+}
+
+static struct ds_slab* adopt_slab(struct ds_heap* heap, int region, int klass) {
+  struct ds_region* r = &regions[region];
+  if (!r->abandoned[klass]) { return 0; }
+  lock(&r->lock);
+  struct ds_slab* s = r->abandoned[klass];
+  if (s) {
+    unlink_slab(&r->abandoned[klass], s);
+    s->owner = heap;
+  }
+  unlock(&r->lock);
+  return s;
+}
+
+// find a slab with free objects for klass and put it at the front of the
+// thread's list, taking over an abandoned slab before carving a new one
+static struct ds_slab* refill(struct ds_heap* heap, int region, int klass) {
+  struct ds_slab** list = &heap->slabs[region][klass];
+  struct ds_slab* s;
+  for (s = *list; s; s = s->next) {
+    if (slab_has_room(s)) {
+      break;
+    }
+  }
+  if (!s) {
+    s = adopt_slab(heap, region, klass);
+    if (!s) {
+      s = new_slab(region, klass);
+      if (!s) { return 0; }
+      s->owner = heap;
+    }
+  } else {
+    unlink_slab(list, s);
+  }
+  link_front(list, s);
+  return s;
+}
+
+void __ds_tc_init(mspace unsafe, void* unsafe_base, size_t unsafe_size,
+                  mspace safe, void* safe_base, size_t safe_size, int enabled) {
+  mspace spaces[DS_N_REGIONS] = { unsafe, safe };
+  void* bases[DS_N_REGIONS] = { unsafe_base, safe_base };
+  size_t sizes[DS_N_REGIONS] = { unsafe_size, safe_size };
+  meta_space = safe;
+  tc_enabled = enabled;
+  for (int i = 0; i < DS_N_REGIONS; ++i) {
+    struct ds_region* r = &regions[i];
+    r->space = spaces[i];
+    if (!enabled) { continue; }
+    r->first = (uintptr_t)bases[i] >> SLAB_SHIFT;
+    r->n_slabs = (((uintptr_t)bases[i] + sizes[i] - 1) >> SLAB_SHIFT) - r->first + 1;
+    r->slabs = mspace_calloc(meta_space, r->n_slabs, sizeof(struct ds_slab*));
+    if (!r->slabs) {
+      tc_enabled = 0;
+      return;
+    }
+  }
+}
+
+void __ds_tc_thread_init(void) {
+  if (!tc_enabled) { return; }
+  __ds_heap = mspace_calloc(meta_space, 1, sizeof(struct ds_heap));
+}
+
+void __ds_tc_thread_exit(void) {
+  struct ds_heap* heap = __ds_heap;
+  if (!heap) { return; }
+  __ds_heap = 0;
+  for (int i = 0; i < DS_N_REGIONS; ++i) {
+    struct ds_region* r = &regions[i];
+    for (int c = 0; c < N_CLASSES; ++c) {
+      struct ds_slab* s = heap->slabs[i][c];
+      while (s) {
+        struct ds_slab* next = s->next;
+        collect_remote(s);
+        if (s->used == 0) {
+          release_slab(s);
+        } else {
+          // objects still in use may be freed by other threads later,
+          // which keep pushing them onto the remote list until some
+          // thread adopts the slab
+          lock(&r->lock);
+          s->owner = 0;
+          link_front(&r->abandoned[c], s);
+          unlock(&r->lock);
+        }
+        s = next;
+      }
+    }
+  }
+  mspace_free(meta_space, heap);
+}
+
+// *dirty is set to how many leading bytes of the result may be non-zero
+static inline void* tc_alloc(int region, size_t n, size_t* dirty) {
+  struct ds_heap* heap = __ds_heap;
+  void* p;
+  if (heap && n <= SMALL_MAX) {
+    int klass = size_class(n);
+    int dirty_slot;
+    struct ds_slab* s = heap->slabs[region][klass];
+    p = s ? slab_pop(s, &dirty_slot) : 0;
+    if (!p && (s = refill(heap, region, klass))) {
+      p = slab_pop(s, &dirty_slot);
+    }
+    if (p) {
+      *dirty = dirty_slot ? n : 0;
+      return p;
+    }
+  }
+  p = mspace_malloc(regions[region].space, n);
+  *dirty = mspace_dirty_size(p);
+  return p;
+}
+
+void* __ds_tc_malloc(int region, size_t n) {
+  size_t dirty;
+  return tc_alloc(region, n, &dirty);
+}
+
+// only clears what isn't known to be zero already, see mspace_dirty_size
+void* __ds_tc_calloc(int region, size_t n, size_t elem_size) {
+  size_t total = n * elem_size;
+  if (elem_size && total / elem_size != n) {
+    errno = ENOMEM;
+    return 0;
+  }
+  size_t dirty;
+  void* p = tc_alloc(region, total, &dirty);
+  if (p) { memset(p, 0, dirty < total ? dirty : total); }
+  return p;
+}
+
+void __ds_tc_free(int region, void* ptr) {
+  struct ds_region* r = &regions[region];
+  struct ds_slab* s = tc_enabled && ptr ? lookup_slab(r, ptr) : 0;
+  if (!s) {
+    mspace_free(r->space, ptr);
+    return;
+  }
+  struct ds_heap* heap = __ds_heap;
+  if (heap && s->owner == heap) {
+    *(void**)ptr = s->free;
+    s->free = ptr;
+    // keep one slab per class around so a malloc/free loop doesn't
+    // go back to dlmalloc every time.  used still counts remote frees
+    // that weren't collected, so nobody else can touch an empty slab
+    if (--s->used == 0 && s->prev) {
+      unlink_slab(&heap->slabs[region][s->klass], s);
+      release_slab(s);
+    }
+    return;
+  }
+  void* head;
+  do {
+    head = s->remote;
+    *(void**)ptr = head;
+  } while (a_cas_p(&s->remote, head, ptr) != head);
+}
+
+size_t __ds_tc_usable_size(int region, void* ptr) {
+  struct ds_region* r = &regions[region];
+  struct ds_slab* s = tc_enabled && ptr ? lookup_slab(r, ptr) : 0;
+  return s ? s->size : mspace_usable_size(ptr);
+}
+
+void* __ds_tc_realloc(int region, void* ptr, size_t n) {
+  struct ds_region* r = &regions[region];
+  struct ds_slab* s = tc_enabled && ptr ? lookup_slab(r, ptr) : 0;
+  if (!s) {
+    return mspace_realloc(r->space, ptr, n);
+  }
+  if (n <= s->size) { return ptr; }
+  void* new_ptr = __ds_tc_malloc(region, n);
+  if (new_ptr) {
+    memcpy(new_ptr, ptr, s->size);
+    __ds_tc_free(region, ptr);
+  }
+  return new_ptr;
+}
+
+#endif
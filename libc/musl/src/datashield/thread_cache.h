@@ -0,0 +1,23 @@
+#ifndef __DS_THREAD_CACHE_H
+#define __DS_THREAD_CACHE_H
+
+#include <stddef.h>
+#include "dlmalloc.h"
+
+// per thread caches on top of the safe and unsafe mspaces.  small requests
+// are served from size class slabs owned by the allocating thread, anything
+// else (and everything while the caches are off) goes to dlmalloc
+enum { DS_UNSAFE_REGION = 0, DS_SAFE_REGION = 1, DS_N_REGIONS = 2 };
+
+void  __ds_tc_init(mspace unsafe, void* unsafe_base, size_t unsafe_size,
+                   mspace safe, void* safe_base, size_t safe_size, int enabled);
+void  __ds_tc_thread_init(void);
+void  __ds_tc_thread_exit(void);
+
+void* __ds_tc_malloc(int region, size_t n);
+void* __ds_tc_calloc(int region, size_t n, size_t elem_size);
+void* __ds_tc_realloc(int region, void* ptr, size_t n);
+void  __ds_tc_free(int region, void* ptr);
+size_t __ds_tc_usable_size(int region, void* ptr);
+
+#endif
@@ -0,0 +1,251 @@
+#ifdef __USE_DATASHIELD
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sys/mman.h>
+#include "atomic.h"
+#include "vaspace.h"
+
+// the free parts of the window are kept as a list of gaps sorted by
+// address.  a mapping takes the top of the highest gap it fits in, which
+// keeps it away from the program image and the brk heap at the bottom.
+//
+// the kernel doesn't know about the list, so every mapping asks for its
+// range without replacing anything there.  when it refuses, something that
+// didn't come through here sits in the range and it stays out of the gaps
+
+#ifndef MAP_FIXED_NOREPLACE
+// kernels before 4.17 ignore the flag and take the address as a hint,
+// which lands somewhere else instead of failing with EEXIST
+#define MAP_FIXED_NOREPLACE (0x100000)
+#endif
+#define PAGE (4096ull)
+#define MAX_TRIES (8)
+
+struct va_gap {
+  uintptr_t start, end;
+  struct va_gap* next;
+};
+
+static struct va_gap* gaps;
+static uintptr_t va_base, va_top;
+static mspace meta_space;
+static volatile int va_lock;
+
+static inline void lock(volatile int* l) {
+  while (a_swap(l, 1)) { a_spin(); }
+}
+
+static inline void unlock(volatile int* l) {
+  a_store(l, 0);
+}
+
+static inline size_t page_round(size_t n) {
+  return (n + PAGE - 1) & ~(PAGE - 1);
+}
+
+void __ds_va_init(mspace meta, uintptr_t base, uintptr_t top) {
+  meta_space = meta;
+  va_base = base;
+  va_top = top;
+  gaps = mspace_malloc(meta_space, sizeof(struct va_gap));
+  if (gaps) {
+    gaps->start = base;
+    gaps->end = top;
+    gaps->next = 0;
+  }
+}
+
+// remove [start, end) from the gaps wherever they overlap
+static int take(uintptr_t start, uintptr_t end) {
+  struct va_gap** link = &gaps;
+  while (*link && (*link)->start < end) {
+    struct va_gap* g = *link;
+    if (g->end <= start) {
+      link = &g->next;
+    } else if (g->start < start && g->end > end) {
+      struct va_gap* hi = mspace_malloc(meta_space, sizeof(struct va_gap));
+      if (!hi) { return 0; }
+      hi->start = end;
+      hi->end = g->end;
+      hi->next = g->next;
+      g->end = start;
+      g->next = hi;
+      return 1;
+    } else if (g->start < start) {
+      g->end = start;
+      link = &g->next;
+    } else if (g->end > end) {
+      g->start = end;
+      return 1;
+    } else {
+      *link = g->next;
+      mspace_free(meta_space, g);
+    }
+  }
+  return 1;
+}
+
+// add [start, end) to the gaps, merging it with the ones it overlaps or
+// touches.  a range nobody knows about is lost if this fails
+static void give(uintptr_t start, uintptr_t end) {
+  struct va_gap** link = &gaps;
+  while (*link && (*link)->end < start) {
+    link = &(*link)->next;
+  }
+  struct va_gap* g = *link;
+  if (g && g->start <= end) {
+    if (start < g->start) { g->start = start; }
+    while (g->next && g->next->start <= end) {
+      struct va_gap* n = g->next;
+      if (n->end > g->end) { g->end = n->end; }
+      g->next = n->next;
+      mspace_free(meta_space, n);
+    }
+    if (end > g->end) { g->end = end; }
+    return;
+  }
+  struct va_gap* n = mspace_malloc(meta_space, sizeof(struct va_gap));
+  if (!n) { return; }
+  n->start = start;
+  n->end = end;
+  n->next = g;
+  *link = n;
+}
+
+static int is_free(uintptr_t start, uintptr_t end) {
+  for (struct va_gap* g = gaps; g && g->start <= start; g = g->next) {
+    if (end <= g->end) { return 1; }
+  }
+  return 0;
+}
+
+// the hint if all of it is free, the top of the highest gap that fits
+// otherwise, 0 if none does
+static uintptr_t find(uintptr_t hint, size_t len) {
+  if (hint && hint + len > hint && is_free(hint, hint + len)) {
+    return hint;
+  }
+  uintptr_t best = 0;
+  for (struct va_gap* g = gaps; g; g = g->next) {
+    if (g->end - g->start >= len) { best = g->end - len; }
+  }
+  return best;
+}
+
+// clip [addr, addr+length) to the window
+static int window(void* addr, size_t length, uintptr_t* start, uintptr_t* end) {
+  *start = (uintptr_t)addr & ~(PAGE - 1);
+  *end = (uintptr_t)addr + page_round(length);
+  if (*end < *start) { *end = va_top; }
+  if (*start < va_base) { *start = va_base; }
+  if (*end > va_top) { *end = va_top; }
+  return *start < *end;
+}
+
+void __ds_va_claim(void* addr, size_t length) {
+  uintptr_t start, end;
+  if (!window(addr, length, &start, &end)) { return; }
+  lock(&va_lock);
+  take(start, end);
+  unlock(&va_lock);
+}
+
+void __ds_va_release(void* addr, size_t length) {
+  uintptr_t start, end;
+  if (!window(addr, length, &start, &end)) { return; }
+  lock(&va_lock);
+  give(start, end);
+  unlock(&va_lock);
+}
+
+void* __ds_va_mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset) {
+  if (flags & MAP_FIXED) {
+    void* p = mmap(addr, length, prot, flags, fd, offset);
+    if (p != MAP_FAILED) { __ds_va_claim(p, length); }
+    return p;
+  }
+  size_t len = page_round(length);
+  if (!length || len < length) {
+    errno = length ? ENOMEM : EINVAL;
+    return MAP_FAILED;
+  }
+  uintptr_t hint = (uintptr_t)addr & ~(PAGE - 1);
+  for (int tries = 0; tries < MAX_TRIES; ++tries) {
+    lock(&va_lock);
+    uintptr_t start = find(hint, len);
+    int ok = start && take(start, start + len);
+    unlock(&va_lock);
+    if (!ok) { break; }
+    void* p = mmap((void*)start, len, prot, flags | MAP_FIXED_NOREPLACE, fd, offset);
+    if (p == (void*)start) { return p; }
+    if (p != MAP_FAILED) {
+      munmap(p, len);
+    } else if (errno != EEXIST) {
+      int err = errno;
+      __ds_va_release((void*)start, len);
+      errno = err;
+      return MAP_FAILED;
+    }
+    hint = 0;
+  }
+  errno = ENOMEM;
+  return MAP_FAILED;
+}
+
+int __ds_va_munmap(void* addr, size_t length) {
+  int rv = munmap(addr, length);
+  if (!rv) { __ds_va_release(addr, length); }
+  return rv;
+}
+
+// fix the gaps up after the kernel moved or resized a mapping
+static void* remapped(void* old_addr, size_t old_len, void* p, size_t new_len) {
+  if (p == MAP_FAILED) { return p; }
+  if (p != old_addr) {
+    __ds_va_release(old_addr, old_len);
+    __ds_va_claim(p, new_len);
+  } else if (new_len < old_len) {
+    __ds_va_release((char*)old_addr + new_len, old_len - new_len);
+  } else {
+    __ds_va_claim((char*)old_addr + old_len, new_len - old_len);
+  }
+  return p;
+}
+
+void* __ds_va_mremap(void* old_addr, size_t old_len, size_t new_len, int flags, void* new_addr) {
+  uintptr_t start = (uintptr_t)old_addr;
+  size_t old_r = page_round(old_len), new_r = page_round(new_len);
+  if (start < va_base || start >= va_top || (flags & MREMAP_FIXED) || new_r <= old_r) {
+    void* p = mremap(old_addr, old_len, new_len, flags, new_addr);
+    return remapped(old_addr, old_r, p, new_r);
+  }
+  // grow in place if the gaps have room right after the mapping
+  lock(&va_lock);
+  int tail = start + new_r > start && is_free(start + old_r, start + new_r)
+             && take(start + old_r, start + new_r);
+  unlock(&va_lock);
+  if (tail) {
+    void* p = mremap(old_addr, old_len, new_len, 0);
+    if (p != MAP_FAILED) { return p; }
+    __ds_va_release((void*)(start + old_r), new_r - old_r);
+  }
+  if (!(flags & MREMAP_MAYMOVE)) {
+    errno = ENOMEM;
+    return MAP_FAILED;
+  }
+  // reserve the new range like any other mapping and move over it
+  void* to = __ds_va_mmap(new_addr, new_len, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (to == MAP_FAILED) { return to; }
+  void* p = mremap(old_addr, old_len, new_len, MREMAP_MAYMOVE | MREMAP_FIXED, to);
+  if (p == MAP_FAILED) {
+    int err = errno;
+    __ds_va_munmap(to, new_len);
+    errno = err;
+    return p;
+  }
+  __ds_va_release(old_addr, old_r);
+  return p;
+}
+
+#endif
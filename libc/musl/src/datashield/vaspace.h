@@ -0,0 +1,26 @@
+#ifndef __DS_VASPACE_H
+#define __DS_VASPACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "dlmalloc.h"
+
+// masked pointers only reach the low 4GB, so everything the unsafe region
+// maps (the heap, the stacks, mmaps of non-sensitive code) has to share
+// that window.  these hand out ranges of [base, top) that don't overlap and
+// keep track of what gets unmapped or remapped.  the bookkeeping is in meta,
+// which has to be in the safe region
+void  __ds_va_init(mspace meta, uintptr_t base, uintptr_t top);
+
+// same as mmap, mremap and munmap, only addr and new_addr are used as
+// hints unless MAP_FIXED/MREMAP_FIXED is given
+void* __ds_va_mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset);
+void* __ds_va_mremap(void* old_addr, size_t old_len, size_t new_len, int flags, void* new_addr);
+int   __ds_va_munmap(void* addr, size_t length);
+
+// for ranges mapped or unmapped without the functions above
+void  __ds_va_claim(void* addr, size_t length);
+void  __ds_va_release(void* addr, size_t length);
+
+#endif
@@ -0,0 +1,17 @@
+/* int __ds_call_on_stack(int (*fn)(void *), void *arg, void *stack_top)
+   runs fn(arg) on the stack below stack_top in the calling thread and
+   returns its result on the original stack */
+.text
+.global __ds_call_on_stack
+.type   __ds_call_on_stack,@function
+__ds_call_on_stack:
+	push %rbp
+	mov %rsp,%rbp
+	and $-16,%rdx
+	mov %rdx,%rsp
+	mov %rdi,%rax
+	mov %rsi,%rdi
+	call *%rax
+	mov %rbp,%rsp
+	pop %rbp
+	ret
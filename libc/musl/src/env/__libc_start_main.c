@@ -13,11 +13,6 @@
 #include "libc.h"
 #include "datashield.h"
 
-#define BOUNDARY ((1ull << 32) - 1)
-#define PAD (4096)
-#define STACK_SIZE (1024*8192)
-#define STACK_HINT (BOUNDARY - PAD - STACK_SIZE)
-
 void __init_tls(size_t *);
 
 static void dummy(void) {}
@@ -102,18 +97,6 @@ int __change_stack_start_main(void* args) {
   }
 	return p->main(p->argc, new_argv, new_envp);
 }
-
-void *__ds_unsafe_stack_top;
-
-int  __ds_unsafe_clone(void (*fn)(void*), void* arg) {
-	int pid = clone(fn, 
-                  __ds_unsafe_stack_top,
-                  SIGCHLD | CLONE_PTRACE | CLONE_VM | CLONE_IO | CLONE_FS | CLONE_FILES,
-                  arg);
-  int status;
-  waitpid(pid, &status, 0); 
-  return WEXITSTATUS(status);
-}
 #endif
 
 int __libc_start_main(int (*main)(int,char **,char **), int argc, char **argv)
@@ -122,30 +105,17 @@ int __libc_start_main(int (*main)(int,char **,char **), int argc, char **argv)
 
 	__init_libc(envp, argv[0]);
 #ifdef __USE_DATASHIELD
+  // maps the unsafe stack along with the regions
   __ds_init();
-  void* stack_bottom = mmap((void*)STACK_HINT,
-                            STACK_SIZE,
-                            PROT_READ | PROT_WRITE,
-                            MAP_PRIVATE | MAP_ANONYMOUS,
-                            -1,
-                            0);
-  if (stack_bottom == MAP_FAILED) {
-    fprintf(stderr, "mapping stack failed!\n");
-    assert(0);
-  }
-
-  __ds_unsafe_stack_top = (void*) (((size_t)stack_bottom) + STACK_SIZE);
 
   struct main_args args;
   args.argc = argc;
   args.argv = argv;
   args.envp = envp;
   args.main = main;
-	//int pid = clone(__change_stack_start_main, __ds_unsafe_stack_top, SIGCHLD | CLONE_PTRACE | CLONE_VM | CLONE_IO | CLONE_FS | CLONE_FILES, (void*)&args);
-
-  //int status;
-  //waitpid(pid, &status, 0); 
-  exit(__ds_unsafe_clone(__change_stack_start_main, (void*)&args));
+  // main runs on the unsafe stack but in this thread, so there is no
+  // second task to wait for and the pid, signals and ptrace work as usual
+  exit(__ds_call_on_stack(__change_stack_start_main, (void*)&args, __ds_unsafe_stack_top));
 #else
 	__libc_start_init();
 	/* Pass control to the application */
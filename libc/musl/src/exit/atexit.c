@@ -16,7 +16,7 @@ static struct fl
 static int slot;
 static volatile int lock[2];
 
-void __funcs_on_exit()
+static void run_funcs()
 {
 	void (*func)(void *), *arg;
 	LOCK(lock);
@@ -24,15 +24,36 @@ void __funcs_on_exit()
 		func = head->f[slot];
 		arg = head->a[slot];
 		UNLOCK(lock);
-#ifdef __USE_DATASHIELD
-    __ds_unsafe_clone(func, arg);
-#else
 		func(arg);
-#endif
 		LOCK(lock);
 	}
 }
 
+#ifdef __USE_DATASHIELD
+#define BOUNDARY ((1ull << 32) - 1)
+
+static int run_funcs_on_stack(void *unused)
+{
+	run_funcs();
+	return 0;
+}
+#endif
+
+void __funcs_on_exit()
+{
+#ifdef __USE_DATASHIELD
+  // the handlers are instrumented and expect the unsafe stack.  exit()
+  // called from main is already on it, otherwise switch once for all of them
+  if ((uintptr_t)__builtin_frame_address(0) < BOUNDARY || !__ds_unsafe_stack_top) {
+    run_funcs();
+  } else {
+    __ds_call_on_stack(run_funcs_on_stack, 0, __ds_unsafe_stack_top);
+  }
+#else
+	run_funcs();
+#endif
+}
+
 void __cxa_finalize(void *dso)
 {
 }
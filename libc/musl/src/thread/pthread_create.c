@@ -2,6 +2,7 @@
 #include "pthread_impl.h"
 #include "stdio_impl.h"
 #include "libc.h"
+#include "datashield.h"
 #include <sys/mman.h>
 #include <string.h>
 #include <stddef.h>
@@ -67,6 +68,10 @@ _Noreturn void __pthread_exit(void *result)
 		exit(0);
 	}
 
+#ifdef __USE_DATASHIELD
+	__ds_thread_exit();
+#endif
+
 	/* Process robust list in userspace to handle non-pshared mutexes
 	 * and the detached thread case where the robust list head will
 	 * be invalid when the kernel would process it. */
@@ -108,6 +113,13 @@ _Noreturn void __pthread_exit(void *result)
 		 * explicitly wait for vmlock holders first. */
 		__vm_wait();
 
+#ifdef __USE_DATASHIELD
+		/* The range is free again as far as the unsafe region is
+		 * concerned. A mapping racing for it in the meantime only
+		 * loses it for good, see __ds_va_mmap. */
+		__ds_va_release(self->map_base, self->map_size);
+#endif
+
 		/* The following call unmaps the thread's stack mapping
 		 * and then exits without touching the stack. */
 		__unmapself(self->map_base, self->map_size);
@@ -142,6 +154,9 @@ static int start(void *p)
 	if (self->unblock_cancel)
 		__syscall(SYS_rt_sigprocmask, SIG_UNBLOCK,
 			SIGPT_SET, 0, _NSIG/8);
+#ifdef __USE_DATASHIELD
+	__ds_thread_init();
+#endif
 	__pthread_exit(self->start(self->start_arg));
 	return 0;
 }
@@ -150,6 +165,9 @@ static int start_c11(void *p)
 {
 	pthread_t self = p;
 	int (*start)(void*) = (int(*)(void*)) self->start;
+#ifdef __USE_DATASHIELD
+	__ds_thread_init();
+#endif
 	__pthread_exit((void *)(uintptr_t)start(self->start_arg));
 	return 0;
 }
@@ -176,6 +194,86 @@ static void init_file_lock(FILE *f)
 
 void *__copy_tls(unsigned char *);
 
+#ifdef __USE_DATASHIELD
+/* masked pointers only reach the low 4GB, so the stacks and tls of new
+ * threads have to live there like the main thread's unsafe stack. the
+ * mappings of joined threads are kept for the next threads instead of
+ * going back to the kernel every time */
+#define map_pages __ds_unsafe_mmap
+#define unmap_pages __ds_unsafe_munmap
+#define STACK_CACHE_SIZE 16
+
+static struct {
+	unsigned char *map;
+	size_t size, guard;
+} stack_cache[STACK_CACHE_SIZE];
+static int stack_cache_count;
+static volatile int stack_cache_lock[2];
+
+static unsigned char *stack_cache_get(size_t size, size_t guard)
+{
+	unsigned char *map = 0;
+	LOCK(stack_cache_lock);
+	for (int i=0; i<stack_cache_count; i++) {
+		if (stack_cache[i].size == size && stack_cache[i].guard == guard) {
+			map = stack_cache[i].map;
+			stack_cache[i] = stack_cache[--stack_cache_count];
+			break;
+		}
+	}
+	UNLOCK(stack_cache_lock);
+	return map;
+}
+
+void __ds_release_thread_stack(pthread_t t)
+{
+	unsigned char *map = t->map_base;
+	size_t size = t->map_size;
+	/* only mappings that hold the stack have the guard layout we reuse */
+	if ((unsigned char *)t->stack > map && (unsigned char *)t->stack <= map + size) {
+		size_t guard = (unsigned char *)t->stack - t->stack_size - map;
+		LOCK(stack_cache_lock);
+		if (stack_cache_count < STACK_CACHE_SIZE) {
+			stack_cache[stack_cache_count].map = map;
+			stack_cache[stack_cache_count].size = size;
+			stack_cache[stack_cache_count].guard = guard;
+			stack_cache_count++;
+			map = 0;
+		}
+		UNLOCK(stack_cache_lock);
+	}
+	if (map) unmap_pages(map, size);
+}
+#else
+#define map_pages __mmap
+#define unmap_pages __munmap
+#endif
+
+static unsigned char *map_stack(size_t size, size_t guard)
+{
+	unsigned char *map;
+#ifdef __USE_DATASHIELD
+	if (guard && (map = stack_cache_get(size, guard))) {
+		/* the thread structure, tls and tsd have to start out zero */
+		memset(map + size - libc.tls_size - __pthread_tsd_size, 0,
+			libc.tls_size + __pthread_tsd_size);
+		return map;
+	}
+#endif
+	if (guard) {
+		map = map_pages(0, size, PROT_NONE, MAP_PRIVATE|MAP_ANON, -1, 0);
+		if (map == MAP_FAILED) return map;
+		if (__mprotect(map+guard, size-guard, PROT_READ|PROT_WRITE)
+		    && errno != ENOSYS) {
+			unmap_pages(map, size);
+			return MAP_FAILED;
+		}
+	} else {
+		map = map_pages(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+	}
+	return map;
+}
+
 int __pthread_create(pthread_t *restrict res, const pthread_attr_t *restrict attrp, void *(*entry)(void *), void *restrict arg)
 {
 	int ret, c11 = (attrp == __ATTRP_C11_THREAD);
@@ -229,18 +327,8 @@ int __pthread_create(pthread_t *restrict res, const pthread_attr_t *restrict att
 	}
 
 	if (!tsd) {
-		if (guard) {
-			map = __mmap(0, size, PROT_NONE, MAP_PRIVATE|MAP_ANON, -1, 0);
-			if (map == MAP_FAILED) goto fail;
-			if (__mprotect(map+guard, size-guard, PROT_READ|PROT_WRITE)
-			    && errno != ENOSYS) {
-				__munmap(map, size);
-				goto fail;
-			}
-		} else {
-			map = __mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
-			if (map == MAP_FAILED) goto fail;
-		}
+		map = map_stack(size, guard);
+		if (map == MAP_FAILED) goto fail;
 		tsd = map + size - __pthread_tsd_size;
 		if (!stack) {
 			stack = tsd - libc.tls_size;
@@ -281,7 +369,7 @@ int __pthread_create(pthread_t *restrict res, const pthread_attr_t *restrict att
 
 	if (ret < 0) {
 		a_dec(&libc.threads_minus_1);
-		if (map) __munmap(map, size);
+		if (map) unmap_pages(map, size);
 		return EAGAIN;
 	}
 
@@ -1,4 +1,5 @@
 #include "pthread_impl.h"
+#include "datashield.h"
 #include <sys/mman.h>
 
 int __munmap(void *, size_t);
@@ -17,7 +18,11 @@ int __pthread_timedjoin_np(pthread_t t, void **res, const struct timespec *at)
 	if (r == ETIMEDOUT || r == EINVAL) return r;
 	a_barrier();
 	if (res) *res = t->result;
+#ifdef __USE_DATASHIELD
+	if (t->map_base) __ds_release_thread_stack(t);
+#else
 	if (t->map_base) __munmap(t->map_base, t->map_size);
+#endif
 	return 0;
 }
 
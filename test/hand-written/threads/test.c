@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define MAX_THREADS 64
+#define MAX_OBJS 64
+
+struct foo {
+  unsigned x;
+  char *y;
+  float z;
+};
+
+__attribute__((annotate("sensitive"))) struct foo aasdfdsafdsafdsaf;
+
+struct worker {
+  pthread_t thread;
+  unsigned id;
+  unsigned rounds;
+  unsigned long sum;
+  // objects handed over by the previous thread, freed by this one
+  struct foo* volatile handoff;
+  struct worker* next;
+};
+
+int remote = 0;
+
+void print_usage() {
+  printf("USAGE: test <number of threads (1-%d)> <rounds per thread> [remote]\n", MAX_THREADS);
+}
+
+void fill(struct foo* arr, unsigned n, unsigned id) {
+  for (unsigned i = 0; i < n; ++i) {
+    arr[i].x = id;
+    arr[i].y = (char*)&arr[i];
+    arr[i].z = (float)i;
+  }
+}
+
+unsigned long check(struct foo* arr, unsigned n, unsigned id) {
+  unsigned long sum = 0;
+  for (unsigned i = 0; i < n; ++i) {
+    if (arr[i].x != id || arr[i].y != (char*)&arr[i]) {
+      fprintf(stderr, "thread %u found a corrupted object!\n", id);
+      abort();
+    }
+    sum += arr[i].x;
+  }
+  return sum;
+}
+
+void* work(void* arg) {
+  struct worker* w = arg;
+  unsigned seed = w->id;
+  for (unsigned r = 0; r < w->rounds; ++r) {
+    unsigned n = rand_r(&seed) % MAX_OBJS + 1;
+    struct foo* arr = malloc(sizeof(struct foo)*n);
+    fill(arr, n, w->id);
+    w->sum += check(arr, n, w->id);
+    if (remote) {
+      // let the next thread free it so frees cross threads
+      arr = __atomic_exchange_n(&w->next->handoff, arr, __ATOMIC_ACQ_REL);
+    }
+    free(arr);
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    print_usage();
+    return 0;
+  }
+  int n = atoi(argv[1]);
+  int rounds = atoi(argv[2]);
+  remote = argc > 3 && !strcmp(argv[3], "remote");
+  if (n <= 0 || n > MAX_THREADS || rounds <= 0) {
+    print_usage();
+    return 0;
+  }
+
+  struct worker workers[MAX_THREADS];
+  for (int i = 0; i < n; ++i) {
+    workers[i].id = i + 1;
+    workers[i].rounds = rounds;
+    workers[i].sum = 0;
+    workers[i].handoff = 0;
+    workers[i].next = &workers[(i + 1) % n];
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < n; ++i) {
+    if (pthread_create(&workers[i].thread, 0, work, &workers[i])) {
+      fprintf(stderr, "could not create thread %d\n", i);
+      return 1;
+    }
+  }
+  for (int i = 0; i < n; ++i) {
+    pthread_join(workers[i].thread, 0);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  for (int i = 0; i < n; ++i) {
+    free(workers[i].handoff);
+  }
+
+  double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("threads: %d rounds: %d%s time: %.3fs allocs/s: %.0f\n",
+         n, rounds, remote ? " (remote frees)" : "", secs, (double)n * rounds / secs);
+  return 0;
+}